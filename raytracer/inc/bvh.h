@@ -2,13 +2,21 @@
 #define BVH_H
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <deque>
 #include <functional>
 #include <memory>
 #include <vector>
 #include <limits>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include <glm/vec3.hpp>
+#include <glm/common.hpp>
 
 #include "ray.h"
 
@@ -28,6 +36,22 @@ public:
     glm::vec3 size() const { return _max - _min; }
     glm::vec3 center() const { return 0.5f * (_max + _min); }
 
+    float surface_area() const
+    {
+        glm::vec3 s = size();
+
+        return 2.0f * (s.x * s.y + s.y * s.z + s.z * s.x);
+    }
+
+    static BoundingBox empty()
+    {
+        return BoundingBox
+        (
+            glm::vec3(std::numeric_limits<float>::infinity()),
+            glm::vec3(-std::numeric_limits<float>::infinity())
+        );
+    }
+
     std::array<glm::vec3, 8> corners() const
     {
         return std::array<glm::vec3, 8>
@@ -43,46 +67,94 @@ public:
         };
     }
 
-    bool intersects(const Ray &r) const
+    float intersect(const Ray &r, double t_max) const
     {
-        float t_min = (_min.x - r.origin().x) * (1.0d / r.direction()).x;
-        float t_max = (_max.x - r.origin().x) * (1.0d / r.direction()).x;
-
-        if (t_min > t_max)
-        {
-            std::swap(t_min, t_max);
-        }
-
-        float t_1 = (_min.y - r.origin().y) * (1.0d / r.direction()).y;
-        float t_2 = (_max.y - r.origin().y) * (1.0d / r.direction()).y;
+        const float robust = 1.0f + 2.0f * 3.0f *
+            std::numeric_limits<float>::epsilon();
+        const glm::vec3 &o = r.box_origin();
+        const glm::vec3 &inv = r.inv_direction();
+        const glm::uvec3 &sign = r.sign();
+
+        // Indexing by the sign picks the near and far planes without a
+        // branch per axis, which rays of all directions mispredict.
+        const glm::vec3 *bounds[2] = { &_min, &_max };
+
+        float t_near_x = (bounds[sign.x]->x - o.x) * inv.x;
+        float t_far_x = (bounds[1 - sign.x]->x - o.x) * inv.x;
+        float t_near_y = (bounds[sign.y]->y - o.y) * inv.y;
+        float t_far_y = (bounds[1 - sign.y]->y - o.y) * inv.y;
+        float t_near_z = (bounds[sign.z]->z - o.z) * inv.z;
+        float t_far_z = (bounds[1 - sign.z]->z - o.z) * inv.z;
+
+        float t_enter = 0.0f;
+        float t_exit = static_cast<float>(t_max);
+
+        t_enter = (t_near_x > t_enter) ? t_near_x : t_enter;
+        t_enter = (t_near_y > t_enter) ? t_near_y : t_enter;
+        t_enter = (t_near_z > t_enter) ? t_near_z : t_enter;
+        t_exit = (t_far_x < t_exit) ? t_far_x : t_exit;
+        t_exit = (t_far_y < t_exit) ? t_far_y : t_exit;
+        t_exit = (t_far_z < t_exit) ? t_far_z : t_exit;
+
+        return (t_enter <= t_exit * robust) ?
+            t_enter : std::numeric_limits<float>::infinity();
+    }
 
-        if (t_1 > t_2)
-        {
-            std::swap(t_1, t_2);
-        }
+    bool intersects(const Ray &r,
+        double t_max = std::numeric_limits<double>::infinity()) const
+    {
+        return intersect(r, t_max) < std::numeric_limits<float>::infinity();
+    }
 
-        if (t_1 > t_max || t_2 < t_min)
-        {
-            return false;
-        }
+    // Rounds double bounds outward, so the box always encloses them.
+    static BoundingBox enclosing(const glm::dvec3 &min,
+        const glm::dvec3 &max)
+    {
+        auto down = [](double x) { return std::nextafter(
+            static_cast<float>(x), -std::numeric_limits<float>::infinity()); };
+        auto up = [](double x) { return std::nextafter(
+            static_cast<float>(x), std::numeric_limits<float>::infinity()); };
 
-        t_min = std::max(t_min, t_1);
+        return BoundingBox
+        (
+            glm::vec3(down(min.x), down(min.y), down(min.z)),
+            glm::vec3(up(max.x), up(max.y), up(max.z))
+        );
+    }
 
+    bool valid() const
+    {
+        return _min.x <= _max.x && _min.y <= _max.y && _min.z <= _max.z;
+    }
 
-        t_1 = (_min.z - r.origin().z) * (1.0d / r.direction()).z;
-        t_2 = (_max.z - r.origin().z) * (1.0d / r.direction()).z;
+    static BoundingBox overlap(const BoundingBox &a, const BoundingBox &b)
+    {
+        return BoundingBox
+        (
+            glm::vec3
+            (
+                std::max(a.min().x, b.min().x),
+                std::max(a.min().y, b.min().y),
+                std::max(a.min().z, b.min().z)
+            ),
+            glm::vec3
+            (
+                std::min(a.max().x, b.max().x),
+                std::min(a.max().y, b.max().y),
+                std::min(a.max().z, b.max().z)
+            )
+        );
+    }
 
-        if (t_1 > t_2)
-        {
-            std::swap(t_1, t_2);
-        }
+    static BoundingBox slab(int axis, float lo, float hi)
+    {
+        glm::vec3 min(-std::numeric_limits<float>::infinity());
+        glm::vec3 max(std::numeric_limits<float>::infinity());
 
-        if (t_1 > t_max || t_2 < t_min)
-        {
-            return false;
-        }
+        min[axis] = lo;
+        max[axis] = hi;
 
-        return t_max > 0;
+        return BoundingBox(min, max);
     }
 
     static BoundingBox combine(const BoundingBox &a, const BoundingBox &b)
@@ -105,12 +177,25 @@ public:
     }
 };
 
+// Morton codes interleave BVH_MORTON_BITS / 3 bits per axis: 63-bit codes
+// (21 bits per axis) by default, or 30-bit codes (10 bits per axis), which
+// need half the radix sort passes.
+#ifndef BVH_MORTON_BITS
+#define BVH_MORTON_BITS 63
+#endif
+
+static_assert(BVH_MORTON_BITS == 63 || BVH_MORTON_BITS == 30,
+    "BVH_MORTON_BITS must be 63 or 30");
+
+constexpr int morton_bits = BVH_MORTON_BITS;
+constexpr int morton_axis_bits = morton_bits / 3;
+
 inline uint64_t morton(uint32_t x, uint32_t y, uint32_t z)
 {
     auto split_by_3 =
         [](uint32_t a)
         {
-            uint64_t val = a >> 11;
+            uint64_t val = a >> (32 - morton_axis_bits);
 
             val = (val | val << 32) & 0x1f00000000ffff;
             val = (val | val << 16) & 0x1f0000ff0000ff;
@@ -126,12 +211,16 @@ inline uint64_t morton(uint32_t x, uint32_t y, uint32_t z)
 
 inline uint64_t morton(const glm::vec3 &pos)
 {
-    return morton
-    (
-        static_cast<uint32_t>(pos.x * std::numeric_limits<uint32_t>::max()),
-        static_cast<uint32_t>(pos.y * std::numeric_limits<uint32_t>::max()),
-        static_cast<uint32_t>(pos.z * std::numeric_limits<uint32_t>::max())
-    );
+    // Scaled in double: UINT32_MAX rounds up to 2^32 as a float, so 1.0
+    // would overflow the conversion.
+    auto quantize =
+        [](float a)
+        {
+            return static_cast<uint32_t>(std::min(std::max(0.0f, a), 1.0f) *
+                static_cast<double>(std::numeric_limits<uint32_t>::max()));
+        };
+
+    return morton(quantize(pos.x), quantize(pos.y), quantize(pos.z));
 }
 
 inline uint64_t morton(const BoundingBox &b, const BoundingBox &total)
@@ -145,224 +234,1631 @@ inline uint64_t morton(const BoundingBox &b, const BoundingBox &total)
     return morton(v);
 }
 
-template <class T>
-class BVH
+inline void radix_sort(std::vector<std::pair<uint64_t, uint32_t>> &values,
+    int bits = 64)
 {
-public:
-    struct Node
-    {
-        BoundingBox box;
+    std::vector<std::pair<uint64_t, uint32_t>> buffer(values.size());
 
-        std::unique_ptr<Node> left;
-        std::unique_ptr<Node> right;
+#ifdef _OPENMP
+    std::vector<size_t> counts(omp_get_max_threads() * 256);
+#else
+    std::vector<size_t> counts(256);
+#endif
 
-        T *object = nullptr;
-        
-        template <typename TFn>
-        void search(const Ray &r, const TFn &fn) const
+    for (int shift = 0; shift < bits; shift += 8)
+    {
+        #pragma omp parallel
         {
-            if (box.intersects(r))
+#ifdef _OPENMP
+            size_t threads = omp_get_num_threads();
+            size_t thread = omp_get_thread_num();
+#else
+            size_t threads = 1;
+            size_t thread = 0;
+#endif
+            size_t begin = values.size() * thread / threads;
+            size_t end = values.size() * (thread + 1) / threads;
+            size_t *count = &counts[thread * 256];
+
+            std::fill(count, count + 256, 0);
+
+            for (size_t i = begin; i < end; ++i)
             {
-                if (object)
-                {
-                    fn(*object);
-                }
+                ++count[(values[i].first >> shift) & 0xff];
+            }
 
-                if (left)
-                {
-                    left->search(r, fn);
-                }
+            #pragma omp barrier
+            #pragma omp single
+            {
+                size_t offset = 0;
 
-                if (right)
+                for (size_t digit = 0; digit < 256; ++digit)
                 {
-                    right->search(r, fn);
+                    for (size_t t = 0; t < threads; ++t)
+                    {
+                        size_t c = counts[t * 256 + digit];
+
+                        counts[t * 256 + digit] = offset;
+                        offset += c;
+                    }
                 }
             }
+
+            for (size_t i = begin; i < end; ++i)
+            {
+                buffer[count[(values[i].first >> shift) & 0xff]++] =
+                    values[i];
+            }
         }
-    };
 
-private:
-    std::unique_ptr<Node> _root;
+        std::swap(values, buffer);
+    }
+}
 
-public:
-    BVH() : _root(nullptr) {}
-    BVH(std::unique_ptr<Node> root) : _root(std::move(root)) {}
+// Counts of BVH traversals and visited nodes. They are only kept in a build
+// with -DBVH_STATISTICS; otherwise record does nothing and the traversals
+// do no extra work. Every thread adds to its own counters on a cache line
+// of their own with a plain load and store rather than a locked add; the
+// counters are summed when read.
+struct BVHStatistics
+{
+#ifdef BVH_STATISTICS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
 
-    const std::unique_ptr<Node> &root() const { return _root; }
+    static constexpr size_t max_threads = 256;
 
-    template <typename TFn>
-    void search(const Ray &r, const TFn &fn) const
+    struct alignas(64) Counters
     {
-        if (_root)
+        std::atomic<uint64_t> traversals;
+        std::atomic<uint64_t> nodes;
+    };
+
+    static inline Counters counters[max_threads];
+
+    static void record(uint64_t visited)
+    {
+        if constexpr (enabled)
         {
-            _root->search(r, fn);
+#ifdef _OPENMP
+            Counters &c = counters[omp_get_thread_num() % max_threads];
+#else
+            Counters &c = counters[0];
+#endif
+
+            c.traversals.store(c.traversals.load(std::memory_order_relaxed) +
+                1, std::memory_order_relaxed);
+            c.nodes.store(c.nodes.load(std::memory_order_relaxed) + visited,
+                std::memory_order_relaxed);
         }
     }
 
-    template <typename TAABBFn>
-    static BVH<T> construct(const std::vector<T *> &objects,
-            size_t delta, const TAABBFn &aabb)
+    static uint64_t traversals()
     {
-        if (objects.empty())
+        uint64_t t = 0;
+
+        for (const Counters &c : counters)
         {
-            return BVH<T>();
+            t += c.traversals.load();
         }
 
-        std::vector<std::tuple<T *, BoundingBox, uint64_t>> objects_sorted;
+        return t;
+    }
 
-        auto box = BoundingBox
-        (
-            glm::vec3(std::numeric_limits<float>::infinity()),
-            glm::vec3(-std::numeric_limits<float>::infinity())
-        );
+    static double nodes_per_traversal()
+    {
+        uint64_t t = traversals();
+        uint64_t n = 0;
 
-        for (T *o : objects)
+        for (const Counters &c : counters)
         {
-            auto o_box = aabb(*o);
+            n += c.nodes.load();
+        }
+
+        return (t > 0) ? static_cast<double>(n) / t : 0.0d;
+    }
+};
+
+struct BVHOptions
+{
+    enum Builder
+    {
+        MORTON,
+        SAH,
+        LBVH,
+        SBVH
+    };
+
+    Builder builder = MORTON;
+    size_t delta = 20;
+    float epsilon = 0.1f;
+    size_t sah_bins = 16;
+    float sbvh_duplication = 0.5f;
+    float sbvh_alpha = 1e-5f;
+    size_t max_leaf_size = 4;
+    size_t treelet_size = 7;
+    size_t treelet_passes = 0;
+    float refit_threshold = 1.5f;
+    bool cache = false;
+    size_t width = 4;
+    bool quantized = false;
+};
+
+template <class T>
+class BVH
+{
+public:
+    struct alignas(32) Node
+    {
+        BoundingBox box;
+        uint32_t offset;
+        uint16_t count;
+        uint16_t axis;
+
+        bool leaf() const { return count > 0; }
+    };
+
+private:
+    struct BuildNode
+    {
+        BoundingBox box;
+        uint32_t left;
+        uint32_t right;
+        uint32_t object;
+
+        bool leaf() const { return left == none; }
+    };
+
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+    static constexpr size_t max_treelet_size = 8;
+
+    struct Treelet
+    {
+        std::array<uint32_t, max_treelet_size> leaves;
+        std::array<uint32_t, max_treelet_size - 2> internal;
+        std::array<float, 1 << max_treelet_size> cost;
+        std::array<uint8_t, 1 << max_treelet_size> partition;
+        size_t count = 0;
+        size_t next = 0;
+    };
+
+public:
+    static constexpr size_t max_depth = 64;
+
+private:
+    std::vector<Node> _nodes;
+    std::vector<T> _objects;
+
+public:
+    BVH() = default;
+    BVH(std::vector<Node> nodes, std::vector<T> objects) :
+        _nodes(std::move(nodes)), _objects(std::move(objects)) {}
 
-            objects_sorted.emplace_back(o, o_box, 0);
-            box = BoundingBox::combine(box, o_box);
+    const std::vector<Node> &nodes() const { return _nodes; }
+    const std::vector<T> &objects() const { return _objects; }
+    size_t memory() const { return _nodes.size() * sizeof(Node); }
+
+    double sah_cost() const
+    {
+        if (_nodes.empty())
+        {
+            return 0.0d;
         }
 
-        for (auto &o : objects_sorted)
+        double cost = 0.0d;
+
+        for (const auto &n : _nodes)
         {
-            std::get<2>(o) = morton(std::get<1>(o), box);
+            cost += n.box.surface_area() * (n.leaf() ? n.count : 1);
         }
 
-        std::sort(objects_sorted.begin(), objects_sorted.end(),
-            [](const auto &t1, const auto &t2)
+        return cost / _nodes[0].box.surface_area();
+    }
+
+    template <typename TFn>
+    void intersect(const Ray &r, double t_max, const TFn &fn) const
+    {
+        intersect_leaves(r, t_max,
+            [&](uint32_t offset, uint32_t count, double &t)
             {
-                return std::get<2>(t1) < std::get<2>(t2);
-            }
-        );
+                for (uint32_t k = offset; k < offset + count; ++k)
+                {
+                    fn(_objects[k], t);
+                }
+            });
+    }
 
-        return BVH<T>
-        (
-            construct_build_tree
-            (
-                objects_sorted,
-                0,
-                objects_sorted.size(),
-                delta,
-                62
-            )
-        );
+    template <typename TFn>
+    bool occluded(const Ray &r, double t_max, const TFn &fn) const
+    {
+        return occluded_leaves(r, t_max,
+            [&](uint32_t offset, uint32_t count)
+            {
+                for (uint32_t k = offset; k < offset + count; ++k)
+                {
+                    if (fn(_objects[k]))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            });
     }
 
-private:
-    static std::unique_ptr<Node> construct_build_tree(
-        const std::vector<std::tuple<T *, BoundingBox, uint64_t>> &objects,
-        size_t start, size_t end, size_t delta, int bit)
+    // Visits the leaves hit by the ray nearest first, passing the range of
+    // objects they hold, so that callers can test a leaf as a whole.
+    template <typename TFn>
+    void intersect_leaves(const Ray &r, double t_max, const TFn &fn) const
     {
-        if (start == end)
+        if (_nodes.empty() || r.degenerate() ||
+            !_nodes[0].box.intersects(r, t_max))
         {
-            return nullptr;
+            return;
         }
 
-        if ((end - start) <= delta || bit < 0)
+        std::array<std::pair<uint32_t, float>, max_depth> stack;
+        size_t size = 0;
+        uint32_t i = 0;
+        uint64_t visited = 0;
+
+        while (true)
         {
-            return construct_combine_primitives(objects, start, end);
+            const Node &n = _nodes[i];
+
+            ++visited;
+
+            if (!n.leaf())
+            {
+                float t_left = _nodes[i + 1].box.intersect(r, t_max);
+                float t_right = _nodes[n.offset].box.intersect(r, t_max);
+
+                if (t_left <= t_right)
+                {
+                    if (t_right < std::numeric_limits<float>::infinity())
+                    {
+                        stack[size++] = std::make_pair(n.offset, t_right);
+                    }
+
+                    if (t_left < std::numeric_limits<float>::infinity())
+                    {
+                        i = i + 1;
+
+                        continue;
+                    }
+                }
+                else
+                {
+                    if (t_left < std::numeric_limits<float>::infinity())
+                    {
+                        stack[size++] = std::make_pair(i + 1, t_left);
+                    }
+
+                    i = n.offset;
+
+                    continue;
+                }
+            }
+            else
+            {
+                fn(n.offset, n.count, t_max);
+            }
+
+            while (size > 0 && stack[size - 1].second > t_max)
+            {
+                --size;
+            }
+
+            if (size == 0)
+            {
+                break;
+            }
+
+            i = stack[--size].first;
         }
-        else
+
+        BVHStatistics::record(visited);
+    }
+
+    template <typename TFn>
+    bool occluded_leaves(const Ray &r, double t_max, const TFn &fn) const
+    {
+        if (_nodes.empty() || r.degenerate() ||
+            !_nodes[0].box.intersects(r, t_max))
+        {
+            return false;
+        }
+
+        std::array<uint32_t, max_depth> stack;
+        size_t size = 0;
+        uint32_t i = 0;
+        uint64_t visited = 0;
+
+        while (true)
         {
-            size_t part = construct_make_partition(objects, start, end, bit);
+            const Node &n = _nodes[i];
 
-            if (part == start || part == end)
+            ++visited;
+
+            if (!n.leaf())
             {
-                return construct_build_tree(objects, start, end,
-                    delta, bit - 1);
+                bool hit_left = _nodes[i + 1].box.intersects(r, t_max);
+                bool hit_right = _nodes[n.offset].box.intersects(r, t_max);
+
+                if (hit_left && hit_right)
+                {
+                    stack[size++] = n.offset;
+                }
+
+                if (hit_left || hit_right)
+                {
+                    i = hit_left ? i + 1 : n.offset;
+
+                    continue;
+                }
             }
-            else
+            else if (fn(n.offset, n.count))
             {
-                auto n = std::make_unique<Node>();
+                BVHStatistics::record(visited);
 
-                n->left = construct_build_tree(objects, start, part,
-                    delta, bit - 1);
-                n->right = construct_build_tree(objects, part, end,
-                    delta, bit - 1);
+                return true;
+            }
 
-                n->box = BoundingBox::combine(n->left->box, n->right->box);
+            if (size == 0)
+            {
+                BVHStatistics::record(visited);
 
-                return n;
+                return false;
             }
+
+            i = stack[--size];
         }
     }
 
-    static size_t construct_make_partition(
-        const std::vector<std::tuple<T*, BoundingBox, uint64_t>>& objects,
-        size_t start, size_t end, int bit)
+    // Recomputes all boxes for objects that have moved, keeping the tree:
+    // leaves are refit in parallel and every node is updated by whichever
+    // of its children finishes last.
+    template <typename TAABBFn>
+    void refit(const TAABBFn &aabb)
     {
-        uint64_t bitmask = 1 << bit;
+        long n = _nodes.size();
+        std::vector<uint32_t> parent(n, none);
+        std::vector<std::atomic<int>> visits(n);
+
+        #pragma omp parallel for
+        for (long i = 0; i < n; ++i)
+        {
+            if (!_nodes[i].leaf())
+            {
+                parent[i + 1] = i;
+                parent[_nodes[i].offset] = i;
+            }
+        }
 
-        while (start < end)
+        #pragma omp parallel for
+        for (long i = 0; i < n; ++i)
         {
-            size_t mid = start + (end - start) / 2;
+            Node &leaf = _nodes[i];
 
-            if ((std::get<2>(objects[start]) & bitmask) == 0)
+            if (!leaf.leaf())
             {
-                start = mid + 1;
+                continue;
             }
-            else
+
+            leaf.box = BoundingBox::empty();
+
+            for (uint32_t k = leaf.offset; k < leaf.offset + leaf.count; ++k)
+            {
+                leaf.box = BoundingBox::combine(leaf.box, aabb(_objects[k]));
+            }
+
+            uint32_t p = parent[i];
+
+            while (p != none && visits[p].fetch_add(1) == 1)
             {
-                end = mid;
+                _nodes[p].box = BoundingBox::combine(_nodes[p + 1].box,
+                    _nodes[_nodes[p].offset].box);
+                p = parent[p];
             }
         }
+    }
 
-        return start;
+    template <typename TAABBFn>
+    static BVH<T> construct(std::vector<T> objects,
+            const BVHOptions &options, const TAABBFn &aabb)
+    {
+        return construct(std::move(objects), options, aabb,
+            [](const T &, int axis, float lo, float hi)
+            {
+                return BoundingBox::slab(axis, lo, hi);
+            }
+        );
     }
 
-    static std::unique_ptr<Node> construct_combine_primitives(
-        const std::vector<std::tuple<T *, BoundingBox, uint64_t>> &objects,
-        size_t start, size_t end)
+    // clip(object, axis, lo, hi) bounds the part of the object lying
+    // between lo and hi along the axis; it is only used by spatial splits.
+    template <typename TAABBFn, typename TClipFn>
+    static BVH<T> construct(std::vector<T> objects,
+            const BVHOptions &options, const TAABBFn &aabb,
+            const TClipFn &clip)
     {
-        std::vector<std::unique_ptr<Node>> clusters;
+        BVH<T> bvh;
 
-        for (size_t i = start; i < end; ++i)
+        if (objects.empty())
         {
-            const auto &o = objects[i];
-            auto new_cluster = std::make_unique<Node>();
+            return bvh;
+        }
 
-            new_cluster->box = std::get<1>(o);
-            new_cluster->object = std::get<0>(o);
+        long n = objects.size();
+        std::vector<BoundingBox> boxes(n);
 
-            clusters.push_back(std::move(new_cluster));
+        #pragma omp parallel for
+        for (long i = 0; i < n; ++i)
+        {
+            boxes[i] = aabb(objects[i]);
         }
 
-        while (clusters.size() > 1)
+        std::vector<BuildNode> tree;
+        uint32_t root;
+
+        switch (options.builder)
         {
-            float best = std::numeric_limits<float>::infinity();
-            size_t i_best = 0;
-            size_t j_best = 0;
+            case BVHOptions::SAH:
+                root = construct_sah(boxes, options.sah_bins, tree);
+                break;
+
+            case BVHOptions::LBVH:
+                root = construct_lbvh(boxes, tree);
+                break;
+
+            case BVHOptions::SBVH:
+                root = construct_sbvh(objects, boxes, options, clip, tree);
+                break;
+
+            default:
+                root = construct_aac(boxes, options.delta, options.epsilon,
+                    tree);
+                break;
+        }
 
-            for (size_t i = 0; i < clusters.size(); ++i)
-            {
-                for (size_t j = i + 1; j < clusters.size(); j++) {
-                    float dist = glm::distance(clusters[i]->box.center(),
-                        clusters[j]->box.center());
+        for (size_t pass = 0; pass < options.treelet_passes; ++pass)
+        {
+            construct_restructure(tree, root, std::min(std::max(
+                options.treelet_size, static_cast<size_t>(3)),
+                max_treelet_size));
+        }
 
-                    if (dist < best)
-                    {
-                        best = dist;
-                        i_best = i;
-                        j_best = j;
-                    }
-                }
-            }
+        std::vector<uint32_t> order;
+
+        bvh.construct_flatten(tree, root, options.max_leaf_size, order);
+        bvh._objects.reserve(order.size());
+
+        for (uint32_t i : order)
+        {
+            bvh._objects.push_back(objects[i]);
+        }
 
-            auto new_cluster = std::make_unique<Node>();
+        return bvh;
+    }
+
+private:
+    static uint32_t construct_leaf(std::vector<BuildNode> &tree,
+        const BoundingBox &box, uint32_t object)
+    {
+        tree.push_back(BuildNode { box, none, none, object });
 
-            new_cluster->box = BoundingBox::combine(clusters[i_best]->box,
-                clusters[j_best]->box);
-            new_cluster->left = std::move(clusters[i_best]);
-            new_cluster->right = std::move(clusters[j_best]);
+        return tree.size() - 1;
+    }
+
+    static uint32_t construct_node(std::vector<BuildNode> &tree,
+        uint32_t left, uint32_t right)
+    {
+        tree.push_back(BuildNode { BoundingBox::combine(tree[left].box,
+            tree[right].box), left, right, none });
 
-            clusters.push_back(std::move(new_cluster));
+        return tree.size() - 1;
+    }
 
-            clusters.erase(clusters.begin() + j_best);
-            clusters.erase(clusters.begin() + i_best);
+    void construct_flatten(const std::vector<BuildNode> &tree, uint32_t root,
+        size_t max_leaf_size, std::vector<uint32_t> &order)
+    {
+        std::vector<uint32_t> counts(tree.size());
+        std::vector<uint32_t> heights(tree.size());
+        std::vector<float> costs(tree.size());
+        std::vector<bool> collapse(tree.size());
+
+        construct_evaluate(tree, root, max_leaf_size, counts, heights, costs,
+            collapse);
+
+        _nodes.reserve(2 * counts[root] - 1);
+        order.reserve(counts[root]);
+
+        construct_emit(tree, root, 0, max_leaf_size, heights, collapse,
+            order);
+    }
+
+    static void construct_evaluate(const std::vector<BuildNode> &tree,
+        uint32_t i, size_t max_leaf_size, std::vector<uint32_t> &counts,
+        std::vector<uint32_t> &heights, std::vector<float> &costs,
+        std::vector<bool> &collapse)
+    {
+        const BuildNode &n = tree[i];
+        float area = n.box.surface_area();
+
+        if (n.leaf())
+        {
+            counts[i] = 1;
+            heights[i] = 0;
+            costs[i] = area;
+            collapse[i] = true;
+
+            return;
+        }
+
+        construct_evaluate(tree, n.left, max_leaf_size, counts, heights,
+            costs, collapse);
+        construct_evaluate(tree, n.right, max_leaf_size, counts, heights,
+            costs, collapse);
+
+        counts[i] = counts[n.left] + counts[n.right];
+
+        float split_cost = area + costs[n.left] + costs[n.right];
+        float leaf_cost = counts[i] * area;
+
+        collapse[i] = counts[i] <= max_leaf_size && leaf_cost <= split_cost;
+        costs[i] = collapse[i] ? leaf_cost : split_cost;
+        heights[i] = collapse[i] ? 0 :
+            1 + std::max(heights[n.left], heights[n.right]);
+    }
+
+    uint32_t construct_emit(const std::vector<BuildNode> &tree, uint32_t i,
+        size_t depth, size_t max_leaf_size,
+        const std::vector<uint32_t> &heights,
+        const std::vector<bool> &collapse, std::vector<uint32_t> &order)
+    {
+        if (depth >= max_depth / 2 && depth + heights[i] > max_depth)
+        {
+            std::vector<uint32_t> leaves;
+
+            construct_collect_leaves(tree, i, leaves);
+
+            return construct_emit_balanced(tree, leaves, 0, leaves.size(),
+                max_leaf_size, order);
+        }
+
+        uint32_t index = _nodes.size();
+
+        _nodes.push_back(Node { tree[i].box, 0, 0, 0 });
+
+        if (collapse[i])
+        {
+            _nodes[index].offset = order.size();
+            construct_collect(tree, i, order);
+            _nodes[index].count = order.size() - _nodes[index].offset;
+        }
+        else
+        {
+            uint32_t left = tree[i].left;
+            uint32_t right = tree[i].right;
+            glm::vec3 d = tree[right].box.center() - tree[left].box.center();
+            glm::vec3 extent = glm::abs(d);
+            uint16_t axis = (extent.x > extent.y) ?
+                ((extent.x > extent.z) ? 0 : 2) :
+                ((extent.y > extent.z) ? 1 : 2);
+
+            if (d[axis] < 0)
+            {
+                std::swap(left, right);
+            }
+
+            _nodes[index].axis = axis;
+
+            construct_emit(tree, left, depth + 1, max_leaf_size, heights,
+                collapse, order);
+            _nodes[index].offset = construct_emit(tree, right, depth + 1,
+                max_leaf_size, heights, collapse, order);
+        }
+
+        return index;
+    }
+
+    uint32_t construct_emit_balanced(const std::vector<BuildNode> &tree,
+        std::vector<uint32_t> &leaves, size_t start, size_t end,
+        size_t max_leaf_size, std::vector<uint32_t> &order)
+    {
+        uint32_t index = _nodes.size();
+        auto box = BoundingBox::empty();
+        auto centroids = BoundingBox::empty();
+
+        for (size_t k = start; k < end; ++k)
+        {
+            glm::vec3 c = tree[leaves[k]].box.center();
+
+            box = BoundingBox::combine(box, tree[leaves[k]].box);
+            centroids = BoundingBox::combine(centroids, BoundingBox(c, c));
+        }
+
+        _nodes.push_back(Node { box, 0, 0, 0 });
+
+        if (end - start <= std::max(max_leaf_size, static_cast<size_t>(1)))
+        {
+            _nodes[index].offset = order.size();
+            _nodes[index].count = end - start;
+
+            for (size_t k = start; k < end; ++k)
+            {
+                order.push_back(tree[leaves[k]].object);
+            }
+
+            return index;
+        }
+
+        glm::vec3 extent = centroids.size();
+        uint16_t axis = (extent.x > extent.y) ?
+            ((extent.x > extent.z) ? 0 : 2) :
+            ((extent.y > extent.z) ? 1 : 2);
+        size_t mid = start + (end - start) / 2;
+
+        std::nth_element(leaves.begin() + start, leaves.begin() + mid,
+            leaves.begin() + end,
+            [&](uint32_t a, uint32_t b)
+            {
+                return tree[a].box.center()[axis] <
+                    tree[b].box.center()[axis];
+            }
+        );
+
+        _nodes[index].axis = axis;
+
+        construct_emit_balanced(tree, leaves, start, mid, max_leaf_size,
+            order);
+        _nodes[index].offset = construct_emit_balanced(tree, leaves, mid, end,
+            max_leaf_size, order);
+
+        return index;
+    }
+
+    static void construct_collect_leaves(const std::vector<BuildNode> &tree,
+        uint32_t i, std::vector<uint32_t> &leaves)
+    {
+        if (tree[i].leaf())
+        {
+            leaves.push_back(i);
+        }
+        else
+        {
+            construct_collect_leaves(tree, tree[i].left, leaves);
+            construct_collect_leaves(tree, tree[i].right, leaves);
+        }
+    }
+
+    static void construct_collect(const std::vector<BuildNode> &tree,
+        uint32_t i, std::vector<uint32_t> &order)
+    {
+        if (tree[i].leaf())
+        {
+            order.push_back(tree[i].object);
+        }
+        else
+        {
+            construct_collect(tree, tree[i].left, order);
+            construct_collect(tree, tree[i].right, order);
+        }
+    }
+
+    // Treelet restructuring (Karras and Aila): every node, bottom-up and in
+    // parallel, becomes the root of a treelet of up to treelet_size
+    // subtrees, which is rebuilt into the topology with the lowest SAH cost.
+    static void construct_restructure(std::vector<BuildNode> &tree,
+        uint32_t root, size_t treelet_size)
+    {
+        std::vector<uint32_t> parent(tree.size(), none);
+        std::vector<uint32_t> leaves;
+        std::vector<uint32_t> stack { root };
+
+        while (!stack.empty())
+        {
+            uint32_t i = stack.back();
+
+            stack.pop_back();
+
+            if (tree[i].leaf())
+            {
+                leaves.push_back(i);
+            }
+            else
+            {
+                parent[tree[i].left] = i;
+                parent[tree[i].right] = i;
+                stack.push_back(tree[i].left);
+                stack.push_back(tree[i].right);
+            }
+        }
+
+        long n = leaves.size();
+        std::vector<float> costs(tree.size());
+        std::vector<std::atomic<int>> visits(tree.size());
+
+        #pragma omp parallel for
+        for (long k = 0; k < n; ++k)
+        {
+            uint32_t p = parent[leaves[k]];
+
+            costs[leaves[k]] = tree[leaves[k]].box.surface_area();
+
+            while (p != none && visits[p].fetch_add(1) == 1)
+            {
+                construct_restructure_treelet(tree, p, treelet_size, costs);
+                p = parent[p];
+            }
+        }
+    }
+
+    static void construct_restructure_treelet(std::vector<BuildNode> &tree,
+        uint32_t root, size_t treelet_size, std::vector<float> &costs)
+    {
+        Treelet t;
+
+        t.leaves[0] = tree[root].left;
+        t.leaves[1] = tree[root].right;
+        t.count = 2;
+
+        while (t.count < treelet_size)
+        {
+            size_t best = t.count;
+            float best_area = -1.0f;
+
+            for (size_t k = 0; k < t.count; ++k)
+            {
+                const BuildNode &n = tree[t.leaves[k]];
+
+                if (!n.leaf() && n.box.surface_area() > best_area)
+                {
+                    best = k;
+                    best_area = n.box.surface_area();
+                }
+            }
+
+            if (best == t.count)
+            {
+                break;
+            }
+
+            uint32_t i = t.leaves[best];
+
+            t.internal[t.count - 2] = i;
+            t.leaves[best] = tree[i].left;
+            t.leaves[t.count++] = tree[i].right;
+        }
+
+        uint32_t subsets = 1u << t.count;
+        std::array<BoundingBox, 1 << max_treelet_size> boxes;
+
+        for (uint32_t s = 1; s < subsets; ++s)
+        {
+            uint32_t lowest = s & (~s + 1);
+            uint32_t rest = s ^ lowest;
+            const BuildNode &leaf = tree[t.leaves[__builtin_ctz(s)]];
+
+            if (rest == 0)
+            {
+                boxes[s] = leaf.box;
+                t.cost[s] = costs[t.leaves[__builtin_ctz(s)]];
+
+                continue;
+            }
+
+            boxes[s] = BoundingBox::combine(boxes[rest], leaf.box);
+
+            // Subsets of s are smaller than s, so their costs are known;
+            // only partitions holding the lowest bit of s are tried to
+            // skip mirrored ones.
+            t.cost[s] = std::numeric_limits<float>::infinity();
+
+            for (uint32_t q = (rest - 1) & rest; ; q = (q - 1) & rest)
+            {
+                uint32_t p = q | lowest;
+                float cost = t.cost[p] + t.cost[s ^ p];
+
+                if (cost < t.cost[s])
+                {
+                    t.cost[s] = cost;
+                    t.partition[s] = p;
+                }
+
+                if (q == 0)
+                {
+                    break;
+                }
+            }
+
+            t.cost[s] += boxes[s].surface_area();
+        }
+
+        construct_treelet_emit(tree, subsets - 1, root, t, costs);
+    }
+
+    static uint32_t construct_treelet_emit(std::vector<BuildNode> &tree,
+        uint32_t s, uint32_t node, Treelet &t, std::vector<float> &costs)
+    {
+        if ((s & (s - 1)) == 0)
+        {
+            return t.leaves[__builtin_ctz(s)];
+        }
+
+        if (node == none)
+        {
+            node = t.internal[t.next++];
+        }
+
+        uint32_t p = t.partition[s];
+
+        tree[node].left = construct_treelet_emit(tree, p, none, t, costs);
+        tree[node].right = construct_treelet_emit(tree, s ^ p, none, t,
+            costs);
+        tree[node].box = BoundingBox::combine(tree[tree[node].left].box,
+            tree[tree[node].right].box);
+        costs[node] = t.cost[s];
+
+        return node;
+    }
+
+    static uint32_t construct_sah(const std::vector<BoundingBox> &boxes,
+        size_t bins, std::vector<BuildNode> &tree)
+    {
+        std::vector<uint32_t> refs(boxes.size());
+
+        for (size_t i = 0; i < refs.size(); ++i)
+        {
+            refs[i] = i;
+        }
+
+        tree.reserve(2 * boxes.size() - 1);
+
+        return construct_sah_split(boxes, refs, 0, refs.size(),
+            std::max(bins, static_cast<size_t>(2)), tree);
+    }
+
+    static uint32_t construct_sah_split(const std::vector<BoundingBox> &boxes,
+        std::vector<uint32_t> &refs, size_t start, size_t end, size_t bins,
+        std::vector<BuildNode> &tree)
+    {
+        if (end - start == 1)
+        {
+            return construct_leaf(tree, boxes[refs[start]], refs[start]);
+        }
+
+        auto split = construct_object_split(end - start, bins,
+            [&](size_t i) -> const BoundingBox &
+            {
+                return boxes[refs[start + i]];
+            }
+        );
+
+        size_t mid = start + (end - start) / 2;
+
+        if (split.axis >= 0)
+        {
+            mid = std::partition(refs.begin() + start, refs.begin() + end,
+                [&](uint32_t r)
+                {
+                    return construct_bin_index(split.centroids, bins,
+                        boxes[r], split.axis) < split.index;
+                }
+            ) - refs.begin();
+        }
+
+        uint32_t left = construct_sah_split(boxes, refs, start, mid, bins,
+            tree);
+        uint32_t right = construct_sah_split(boxes, refs, mid, end, bins,
+            tree);
+
+        return construct_node(tree, left, right);
+    }
+
+    struct Split
+    {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        size_t index = 0;
+        size_t left_count = 0;
+        size_t right_count = 0;
+        BoundingBox centroids = BoundingBox::empty();
+        BoundingBox left = BoundingBox::empty();
+        BoundingBox right = BoundingBox::empty();
+    };
+
+    struct Bin
+    {
+        BoundingBox box = BoundingBox::empty();
+        size_t count = 0;
+        size_t exit = 0;
+    };
+
+    static size_t construct_bin_index(const BoundingBox &centroids,
+        size_t bins, const BoundingBox &box, int axis)
+    {
+        float extent = centroids.max()[axis] - centroids.min()[axis];
+        auto i = static_cast<size_t>(bins *
+            ((box.center()[axis] - centroids.min()[axis]) / extent));
+
+        return std::min(i, bins - 1);
+    }
+
+    // Sweeps the bins of one axis and keeps the cheapest split in best.
+    // Bin::count holds the references entering a bin and Bin::exit the
+    // ones leaving it; for object splits both are the same.
+    static void construct_sweep_bins(const std::vector<Bin> &b, int axis,
+        size_t total, Split &best)
+    {
+        size_t bins = b.size();
+        std::vector<Bin> right(bins);
+        auto box = BoundingBox::empty();
+        size_t count = 0;
+
+        for (size_t i = bins - 1; i > 0; --i)
+        {
+            box = BoundingBox::combine(box, b[i].box);
+            count += b[i].exit;
+            right[i] = Bin { box, count, 0 };
+        }
+
+        box = BoundingBox::empty();
+        count = 0;
+
+        for (size_t i = 1; i < bins; ++i)
+        {
+            box = BoundingBox::combine(box, b[i - 1].box);
+            count += b[i - 1].count;
+
+            const Bin &r = right[i];
+            float cost =
+                ((r.count > 0) ? r.count * r.box.surface_area() : 0.0f) +
+                ((count > 0) ? count * box.surface_area() : 0.0f);
+
+            if (count > 0 && r.count > 0 &&
+                (count < total || r.count < total) && cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.index = i;
+                best.left_count = count;
+                best.right_count = r.count;
+                best.left = box;
+                best.right = r.box;
+            }
+        }
+    }
+
+    template <typename TBoxFn>
+    static Split construct_object_split(size_t count, size_t bins,
+        const TBoxFn &box)
+    {
+        Split best;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            glm::vec3 c = box(i).center();
+
+            best.centroids = BoundingBox::combine(best.centroids,
+                BoundingBox(c, c));
+        }
+
+        std::vector<Bin> b(bins);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (best.centroids.max()[axis] <= best.centroids.min()[axis])
+            {
+                continue;
+            }
+
+            std::fill(b.begin(), b.end(), Bin());
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                auto &bin = b[construct_bin_index(best.centroids, bins,
+                    box(i), axis)];
+
+                bin.box = BoundingBox::combine(bin.box, box(i));
+                ++bin.count;
+                ++bin.exit;
+            }
+
+            construct_sweep_bins(b, axis, count, best);
+        }
+
+        return best;
+    }
+
+    struct Reference
+    {
+        BoundingBox box;
+        uint32_t object;
+    };
+
+    template <typename TClipFn>
+    static uint32_t construct_sbvh(const std::vector<T> &objects,
+        const std::vector<BoundingBox> &boxes, const BVHOptions &options,
+        const TClipFn &clip, std::vector<BuildNode> &tree)
+    {
+        std::vector<Reference> refs(boxes.size());
+        auto box = BoundingBox::empty();
+
+        for (size_t i = 0; i < refs.size(); ++i)
+        {
+            refs[i] = Reference { boxes[i], static_cast<uint32_t>(i) };
+            box = BoundingBox::combine(box, boxes[i]);
+        }
+
+        size_t budget = static_cast<size_t>(std::max(0.0f,
+            options.sbvh_duplication) * boxes.size());
+        float min_overlap = options.sbvh_alpha * box.surface_area();
+
+        tree.reserve(2 * (boxes.size() + budget) - 1);
+
+        return construct_sbvh_split(objects, clip, std::move(refs),
+            std::max(options.sah_bins, static_cast<size_t>(2)), min_overlap,
+            budget, tree);
+    }
+
+    template <typename TClipFn>
+    static uint32_t construct_sbvh_split(const std::vector<T> &objects,
+        const TClipFn &clip, std::vector<Reference> refs, size_t bins,
+        float min_overlap, size_t budget, std::vector<BuildNode> &tree)
+    {
+        if (refs.size() == 1)
+        {
+            return construct_leaf(tree, refs[0].box, refs[0].object);
+        }
+
+        auto split = construct_object_split(refs.size(), bins,
+            [&](size_t i) -> const BoundingBox &
+            {
+                return refs[i].box;
+            }
+        );
+
+        // Spatial splits only pay off when the children of the best object
+        // split overlap noticeably, and only while duplicates are allowed.
+        auto overlap = BoundingBox::overlap(split.left, split.right);
+        Split spatial;
+        auto box = BoundingBox::empty();
+
+        for (const auto &r : refs)
+        {
+            box = BoundingBox::combine(box, r.box);
+        }
+
+        if (budget > 0 && (split.axis < 0 ||
+            (overlap.valid() && overlap.surface_area() > min_overlap)))
+        {
+            spatial = construct_spatial_split(objects, clip, refs, box,
+                bins);
+        }
+
+        std::vector<Reference> left;
+        std::vector<Reference> right;
+
+        if (spatial.axis >= 0 && spatial.cost < split.cost)
+        {
+            int axis = spatial.axis;
+            float position = construct_spatial_position(box, bins, axis,
+                spatial.index);
+            float left_area = spatial.left.surface_area();
+            float right_area = spatial.right.surface_area();
+            size_t left_count = spatial.left_count;
+            size_t right_count = spatial.right_count;
+
+            for (const auto &r : refs)
+            {
+                if (r.box.max()[axis] <= position)
+                {
+                    left.push_back(r);
+                }
+                else if (r.box.min()[axis] >= position)
+                {
+                    right.push_back(r);
+                }
+                else
+                {
+                    // Keep the reference whole on one side when that is
+                    // cheaper than splitting it (reference unsplitting).
+                    float split_cost = left_area * left_count +
+                        right_area * right_count;
+                    float left_cost = BoundingBox::combine(spatial.left,
+                        r.box).surface_area() * left_count +
+                        right_area * (right_count - 1);
+                    float right_cost = left_area * (left_count - 1) +
+                        BoundingBox::combine(spatial.right,
+                        r.box).surface_area() * right_count;
+
+                    auto l = BoundingBox::overlap(r.box,
+                        clip(objects[r.object], axis,
+                        -std::numeric_limits<float>::infinity(), position));
+                    auto h = BoundingBox::overlap(r.box,
+                        clip(objects[r.object], axis, position,
+                        std::numeric_limits<float>::infinity()));
+
+                    if (budget == 0 || !l.valid() || !h.valid() ||
+                        std::min(left_cost, right_cost) <= split_cost)
+                    {
+                        bool to_left = (budget == 0 || (l.valid() &&
+                            h.valid())) ? left_cost <= right_cost :
+                            l.valid();
+
+                        (to_left ? left : right).push_back(r);
+                    }
+                    else
+                    {
+                        left.push_back(Reference { l, r.object });
+                        right.push_back(Reference { h, r.object });
+                        --budget;
+                    }
+                }
+            }
+        }
+        else if (split.axis >= 0)
+        {
+            for (const auto &r : refs)
+            {
+                (construct_bin_index(split.centroids, bins, r.box,
+                    split.axis) < split.index ? left : right).push_back(r);
+            }
+        }
+
+        if (left.empty() || right.empty())
+        {
+            size_t mid = refs.size() / 2;
+
+            left.assign(refs.begin(), refs.begin() + mid);
+            right.assign(refs.begin() + mid, refs.end());
+        }
+
+        refs.clear();
+        refs.shrink_to_fit();
+
+        // Share the remaining duplicates between the children by size, so
+        // the first subtree built does not exhaust the whole budget.
+        size_t left_budget = budget * left.size() /
+            (left.size() + right.size());
+        size_t right_budget = budget - left_budget;
+
+        uint32_t l = construct_sbvh_split(objects, clip, std::move(left),
+            bins, min_overlap, left_budget, tree);
+        uint32_t r = construct_sbvh_split(objects, clip, std::move(right),
+            bins, min_overlap, right_budget, tree);
+
+        return construct_node(tree, l, r);
+    }
+
+    static float construct_spatial_position(const BoundingBox &box,
+        size_t bins, int axis, size_t i)
+    {
+        float extent = box.max()[axis] - box.min()[axis];
+
+        return (i == bins) ? box.max()[axis] :
+            box.min()[axis] + extent * i / bins;
+    }
+
+    template <typename TClipFn>
+    static Split construct_spatial_split(const std::vector<T> &objects,
+        const TClipFn &clip, const std::vector<Reference> &refs,
+        const BoundingBox &box, size_t bins)
+    {
+        Split best;
+        std::vector<Bin> b(bins);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float extent = box.max()[axis] - box.min()[axis];
+
+            if (extent <= 0)
+            {
+                continue;
+            }
+
+            std::fill(b.begin(), b.end(), Bin());
+
+            auto bin_index =
+                [&](float x)
+                {
+                    auto i = static_cast<size_t>(std::max(0.0f,
+                        bins * ((x - box.min()[axis]) / extent)));
+
+                    return std::min(i, bins - 1);
+                };
+
+            for (const auto &r : refs)
+            {
+                size_t first = bin_index(r.box.min()[axis]);
+                size_t last = bin_index(r.box.max()[axis]);
+
+                for (size_t i = first; i <= last; ++i)
+                {
+                    auto part = (first == last) ? r.box :
+                        BoundingBox::overlap(r.box, clip(objects[r.object],
+                        axis, construct_spatial_position(box, bins, axis, i),
+                        construct_spatial_position(box, bins, axis, i + 1)));
+
+                    if (part.valid())
+                    {
+                        b[i].box = BoundingBox::combine(b[i].box, part);
+                    }
+                }
+
+                ++b[first].count;
+                ++b[last].exit;
+            }
+
+            construct_sweep_bins(b, axis, refs.size(), best);
+        }
+
+        return best;
+    }
+
+    static uint32_t construct_lbvh(const std::vector<BoundingBox> &boxes,
+        std::vector<BuildNode> &tree)
+    {
+        long n = boxes.size();
+        auto box = BoundingBox::empty();
+
+        #pragma omp parallel
+        {
+            auto local_box = BoundingBox::empty();
+
+            #pragma omp for nowait
+            for (long i = 0; i < n; ++i)
+            {
+                local_box = BoundingBox::combine(local_box, boxes[i]);
+            }
+
+            #pragma omp critical
+            box = BoundingBox::combine(box, local_box);
+        }
+
+        std::vector<std::pair<uint64_t, uint32_t>> codes(n);
+
+        #pragma omp parallel for
+        for (long i = 0; i < n; ++i)
+        {
+            codes[i] = std::make_pair(morton(boxes[i], box),
+                static_cast<uint32_t>(i));
+        }
+
+        radix_sort(codes, morton_bits);
+
+        tree.resize(2 * n - 1);
+
+        #pragma omp parallel for
+        for (long i = 0; i < n; ++i)
+        {
+            tree[n - 1 + i] = BuildNode { boxes[codes[i].second], none, none,
+                codes[i].second };
+        }
+
+        auto delta =
+            [&](long i, long j)
+            {
+                if (j < 0 || j >= n)
+                {
+                    return -1;
+                }
+
+                uint64_t a = codes[i].first;
+                uint64_t b = codes[j].first;
+
+                return (a == b) ?
+                    64 + __builtin_clzll(static_cast<uint64_t>(i ^ j)) :
+                    __builtin_clzll(a ^ b);
+            };
+
+        std::vector<long> parent(2 * n - 1, -1);
+
+        #pragma omp parallel for
+        for (long i = 0; i < n - 1; ++i)
+        {
+            long d = (delta(i, i + 1) > delta(i, i - 1)) ? 1 : -1;
+            int delta_min = delta(i, i - d);
+            long l_max = 2;
+
+            while (delta(i, i + l_max * d) > delta_min)
+            {
+                l_max *= 2;
+            }
+
+            long l = 0;
+
+            for (long t = l_max / 2; t >= 1; t /= 2)
+            {
+                if (delta(i, i + (l + t) * d) > delta_min)
+                {
+                    l += t;
+                }
+            }
+
+            long j = i + l * d;
+            int delta_node = delta(i, j);
+            long s = 0;
+            long t = l;
+
+            do
+            {
+                t = (t + 1) / 2;
+
+                if (s + t < l && delta(i, i + (s + t) * d) > delta_node)
+                {
+                    s += t;
+                }
+            }
+            while (t > 1);
+
+            long gamma = i + s * d + std::min(d, 0l);
+
+            tree[i].left = (std::min(i, j) == gamma) ? n - 1 + gamma : gamma;
+            tree[i].right = (std::max(i, j) == gamma + 1) ?
+                n + gamma : gamma + 1;
+            tree[i].object = none;
+
+            parent[tree[i].left] = i;
+            parent[tree[i].right] = i;
+        }
+
+        std::vector<std::atomic<int>> visits(n - 1);
+
+        #pragma omp parallel for
+        for (long i = n - 1; i < 2 * n - 1; ++i)
+        {
+            long p = parent[i];
+
+            while (p >= 0 && visits[p].fetch_add(1) == 1)
+            {
+                tree[p].box = BoundingBox::combine(tree[tree[p].left].box,
+                    tree[tree[p].right].box);
+                p = parent[p];
+            }
+        }
+
+        return 0;
+    }
+
+    static uint32_t construct_aac(const std::vector<BoundingBox> &boxes,
+        size_t delta, float epsilon, std::vector<BuildNode> &tree)
+    {
+        auto box = BoundingBox::empty();
+
+        for (const auto &b : boxes)
+        {
+            box = BoundingBox::combine(box, b);
+        }
+
+        std::vector<std::pair<uint64_t, uint32_t>> codes(boxes.size());
+
+        for (size_t i = 0; i < boxes.size(); ++i)
+        {
+            codes[i] = std::make_pair(morton(boxes[i], box),
+                static_cast<uint32_t>(i));
+        }
+
+        radix_sort(codes, morton_bits);
+        tree.reserve(2 * boxes.size() - 1);
+
+        long n = codes.size();
+        std::vector<uint8_t> prefixes(std::max(n - 1, 0l));
+
+        #pragma omp parallel for
+        for (long i = 0; i < n - 1; ++i)
+        {
+            uint64_t a = codes[i].first;
+            uint64_t b = codes[i + 1].first;
+
+            prefixes[i] = (a == b) ? 64 : __builtin_clzll(a ^ b);
+        }
+
+        return construct_combine_clusters
+        (
+            construct_build_tree
+            (
+                codes,
+                prefixes,
+                boxes,
+                0,
+                codes.size(),
+                delta,
+                epsilon,
+                tree
+            ),
+            1,
+            tree
+        )[0];
+    }
+
+    static std::vector<uint32_t> construct_build_tree(
+        const std::vector<std::pair<uint64_t, uint32_t>> &objects,
+        const std::vector<uint8_t> &prefixes,
+        const std::vector<BoundingBox> &boxes,
+        size_t start, size_t end, size_t delta, float epsilon,
+        std::vector<BuildNode> &tree)
+    {
+        if (start == end)
+        {
+            return std::vector<uint32_t>();
+        }
+
+        if ((end - start) <= delta)
+        {
+            std::vector<uint32_t> clusters;
+
+            for (size_t i = start; i < end; ++i)
+            {
+                uint32_t o = objects[i].second;
+
+                clusters.push_back(construct_leaf(tree, boxes[o], o));
+            }
+
+            return construct_combine_clusters(std::move(clusters),
+                construct_reduction(delta, delta, epsilon), tree);
+        }
+
+        size_t part = construct_make_partition(prefixes, start, end);
+
+        auto clusters = construct_build_tree(objects, prefixes, boxes, start,
+            part, delta, epsilon, tree);
+        auto right = construct_build_tree(objects, prefixes, boxes, part,
+            end, delta, epsilon, tree);
+
+        clusters.insert(clusters.end(), right.begin(), right.end());
+
+        return construct_combine_clusters(std::move(clusters),
+            construct_reduction(end - start, delta, epsilon), tree);
+    }
+
+    // The codes of a sorted range first differ between the adjacent pair
+    // with the shortest common prefix, which is where the range is split;
+    // ranges of equal codes are halved.
+    static size_t construct_make_partition(
+        const std::vector<uint8_t> &prefixes, size_t start, size_t end)
+    {
+        size_t part = start + (end - start) / 2;
+        uint8_t shortest = 64;
+
+        for (size_t i = start; i + 1 < end; ++i)
+        {
+            if (prefixes[i] < shortest)
+            {
+                shortest = prefixes[i];
+                part = i + 1;
+            }
+        }
+
+        return part;
+    }
+
+    static size_t construct_reduction(size_t n, size_t delta, float epsilon)
+    {
+        double c = std::pow(static_cast<double>(delta), 0.5d + epsilon) / 2;
+
+        return std::max(static_cast<size_t>(std::ceil(c *
+            std::pow(static_cast<double>(n), 0.5d - epsilon))),
+            static_cast<size_t>(1));
+    }
+
+    static std::vector<uint32_t> construct_combine_clusters(
+        std::vector<uint32_t> clusters, size_t n,
+        std::vector<BuildNode> &tree)
+    {
+        if (clusters.size() <= n)
+        {
+            return clusters;
+        }
+
+        const size_t stale = std::numeric_limits<size_t>::max();
+        std::vector<size_t> nearest(clusters.size());
+        std::vector<float> distance(clusters.size());
+
+        auto cost =
+            [&](size_t i, size_t j)
+            {
+                return BoundingBox::combine(tree[clusters[i]].box,
+                    tree[clusters[j]].box).surface_area();
+            };
+
+        auto find_nearest =
+            [&](size_t i)
+            {
+                distance[i] = std::numeric_limits<float>::infinity();
+
+                for (size_t j = 0; j < clusters.size(); ++j)
+                {
+                    if (j == i)
+                    {
+                        continue;
+                    }
+
+                    float d = cost(i, j);
+
+                    if (d < distance[i])
+                    {
+                        distance[i] = d;
+                        nearest[i] = j;
+                    }
+                }
+            };
+
+        for (size_t i = 0; i < clusters.size(); ++i)
+        {
+            find_nearest(i);
+        }
+
+        while (clusters.size() > n)
+        {
+            size_t i_best = std::min_element(distance.begin(),
+                distance.end()) - distance.begin();
+            size_t j_best = nearest[i_best];
+
+            clusters[i_best] = construct_node(tree, clusters[i_best],
+                clusters[j_best]);
+
+            for (size_t k = 0; k < clusters.size(); ++k)
+            {
+                if (nearest[k] == i_best || nearest[k] == j_best)
+                {
+                    nearest[k] = stale;
+                }
+            }
+
+            size_t last = clusters.size() - 1;
+
+            clusters[j_best] = clusters[last];
+            nearest[j_best] = nearest[last];
+            distance[j_best] = distance[last];
+
+            clusters.pop_back();
+            nearest.pop_back();
+            distance.pop_back();
+
+            for (size_t k = 0; k < clusters.size(); ++k)
+            {
+                if (nearest[k] == last)
+                {
+                    nearest[k] = j_best;
+                }
+            }
+
+            if (i_best == last)
+            {
+                i_best = j_best;
+            }
+
+            find_nearest(i_best);
+
+            for (size_t k = 0; k < clusters.size(); ++k)
+            {
+                if (k == i_best)
+                {
+                    continue;
+                }
+
+                if (nearest[k] == stale)
+                {
+                    find_nearest(k);
+                }
+                else
+                {
+                    float d = cost(k, i_best);
+
+                    if (d < distance[k])
+                    {
+                        distance[k] = d;
+                        nearest[k] = i_best;
+                    }
+                }
+            }
         }
 
-        return std::move(clusters[0]);
+        return clusters;
     }
 };
 
@@ -86,6 +86,8 @@ public:
     }
 
     int save_bmp(const std::string &fname) const;
+    // Reads an uncompressed 24-bit BMP, such as those written by save_bmp.
+    bool load_bmp(const std::string &fname);
 };
 
 #endif // IMAGE_H
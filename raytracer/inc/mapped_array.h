@@ -0,0 +1,65 @@
+#ifndef MAPPED_ARRAY_H
+#define MAPPED_ARRAY_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// An array that either owns its elements or refers to them inside a file
+// mapping, which it keeps alive, so that a cached structure is used in
+// place. Mappings are private and writable: writing an element copies only
+// the page it is on. Copying the array copies the elements into one it
+// owns.
+template <typename T>
+class MappedArray
+{
+    std::vector<T> _owned;
+    std::shared_ptr<void> _mapping;
+    T *_data = nullptr;
+    size_t _size = 0;
+
+public:
+    MappedArray() = default;
+    MappedArray(std::vector<T> elements) :
+        _owned(std::move(elements)), _data(_owned.data()),
+        _size(_owned.size()) {}
+    MappedArray(std::shared_ptr<void> mapping, T *data, size_t size) :
+        _mapping(std::move(mapping)), _data(data), _size(size) {}
+
+    MappedArray(const MappedArray &other) :
+        MappedArray(std::vector<T>(other.begin(), other.end())) {}
+    MappedArray(MappedArray &&other) noexcept { *this = std::move(other); }
+
+    MappedArray &operator=(const MappedArray &other)
+    {
+        return *this = MappedArray(other);
+    }
+
+    MappedArray &operator=(MappedArray &&other) noexcept
+    {
+        _owned = std::move(other._owned);
+        _mapping = std::move(other._mapping);
+        _data = other._data;
+        _size = other._size;
+        other._data = nullptr;
+        other._size = 0;
+
+        return *this;
+    }
+
+    bool mapped() const { return _mapping != nullptr; }
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+
+    T *data() { return _data; }
+    const T *data() const { return _data; }
+    T &operator[](size_t i) { return _data[i]; }
+    const T &operator[](size_t i) const { return _data[i]; }
+
+    T *begin() { return _data; }
+    T *end() { return _data + _size; }
+    const T *begin() const { return _data; }
+    const T *end() const { return _data + _size; }
+};
+
+#endif // MAPPED_ARRAY_H
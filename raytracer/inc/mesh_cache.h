@@ -0,0 +1,52 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "object.h"
+#include "bvh.h"
+
+// Binary cache of a built mesh: the structures it is traced with, that is
+// the wide BVH (or the binary one when the mesh keeps it) and the triangle
+// blocks, along with the triangles in leaf order and the vertices. A file
+// is only accepted when its version, layout and key match, the key being a
+// hash of the size and modification time of the source file and of the
+// build options. Loading maps the file and traces the wide nodes and the
+// triangle blocks where they lie in the mapping.
+class MeshCache
+{
+public:
+    static constexpr uint32_t version = 3;
+
+    // Empty when the source file cannot be examined.
+    static std::optional<uint64_t> key(const std::string &path,
+        const BVHOptions &options);
+
+    static bool save(const std::string &path, uint64_t key, const Mesh &mesh);
+    static std::unique_ptr<Mesh> load(const std::string &path, uint64_t key,
+        const Material *material, const BVHOptions &options);
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t node_size;
+        uint32_t wide_node_size;
+        uint32_t block_size;
+        uint64_t key;
+        double built_sah_cost;
+        float box[6];
+        uint64_t nodes;
+        uint64_t wide_nodes;
+        uint64_t blocks;
+        uint64_t vertices;
+        uint64_t triangles;
+        uint64_t reserved[2];
+    };
+};
+
+#endif // MESH_CACHE_H
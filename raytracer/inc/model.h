@@ -13,7 +13,8 @@ class Model
     std::unique_ptr<Mesh> _mesh;
 
 public:    
-    bool load(const std::string &f_name, const Material *material);
+    bool load(const std::string &f_name, const Material *material,
+        const BVHOptions &bvh_options = BVHOptions());
     
     std::unique_ptr<Mesh> &mesh() { return _mesh; }
 };
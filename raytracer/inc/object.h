@@ -1,80 +1,190 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+#include <cmath>
+#include <limits>
 #include <optional>
 #include <memory>
 #include <vector>
 
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/geometric.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "ray.h"
 #include "material.h"
 #include "bvh.h"
+#include "wide_bvh.h"
+#include "triangle_blocks.h"
+#include "simd.h"
+
+class Object;
 
 class Intersection
 {
     glm::dvec3 _point;
-    glm::dvec3 _normal;
+    svec3 _normal;
     double _distance;
     
     const Material *_material;
+    const Object *_object;
 
 public:
-    Intersection(const glm::dvec3 &point, const glm::dvec3 &normal,
-            double distance, const Material *material) :
+    Intersection(const glm::dvec3 &point, const svec3 &normal,
+            double distance, const Material *material,
+            const Object *object) :
         _point(point), _normal(normal), _distance(distance),
-        _material(material) {}
+        _material(material), _object(object) {}
 
     const glm::dvec3 &point() const { return _point; }
-    const glm::dvec3 &normal() const { return _normal; }
+    const svec3 &normal() const { return _normal; }
     double distance() const { return _distance; }
     const Material *material() const { return _material; }
+    const Object *object() const { return _object; }
+};
+
+// A point drawn on the surface of an object with its normal and the
+// density it was drawn with, per unit area.
+struct SurfaceSample
+{
+    glm::dvec3 point;
+    glm::dvec3 normal;
+    double pdf;
+
+    // The density per unit solid angle as seen from a point, for either
+    // side of the surface.
+    double solid_angle_pdf(const glm::dvec3 &from) const;
+};
+
+// A ray hit as found during traversal: the distance along the ray, the
+// primitive of the object that was hit and its surface coordinates there
+// (barycentrics for triangles). The point and normal are only computed,
+// by Object::intersection, for the hit that is kept.
+struct Hit
+{
+    double distance = std::numeric_limits<double>::infinity();
+    uint32_t primitive = 0;
+    glm::vec2 uv = glm::vec2(0.0f);
+    const Object *object = nullptr;
 };
 
 class Object
 {
     const Material *_material;
+    bool _light = false;
 
 public:
     Object(const Material *material) :
         _material(material) {}
 
-    virtual std::optional<Intersection> find_intersection(const Ray &r)
+    // Records a hit closer than hit.distance, returning whether there was
+    // one.
+    virtual bool intersect(const Ray &r, Hit &hit) const = 0;
+    virtual Intersection intersection(const Ray &r, const Hit &hit)
         const = 0;
+    virtual bool occluded(const Ray &r, double t_max) const;
+    std::optional<Intersection> find_intersection(const Ray &r) const;
+    virtual std::optional<BoundingBox> bounds() const;
+    // Draws a point uniformly over the surface from u in [0, 1)^2, for
+    // objects that can be sampled as area lights.
+    virtual std::optional<SurfaceSample> sample(const glm::dvec2 &u) const;
     const Material *material() const { return _material; }
+    // Whether the scene samples the object directly as a light; set once
+    // when the scene is built.
+    bool light() const { return _light; }
+    void set_light(bool light) { _light = light; }
 };
 
 class Sphere : public Object
 {
-    glm::dvec3 _center;
-    double _radius;
+    svec3 _center;
+    scalar _radius;
 
 public:
-    Sphere(const glm::dvec3 &center, double radius,
+    // Parameters as distance() takes them, for one sphere (T = double) or
+    // a pack of them (T = simd::dlanes).
+    template <typename T>
+    struct Packed
+    {
+        simd::vec3<T> center;
+        T radius;
+
+        void set(size_t lane, const Packed<double> &s)
+        {
+            simd::set(center, lane, s.center);
+            simd::set(radius, lane, s.radius);
+        }
+    };
+
+    Sphere(const svec3 &center, scalar radius,
             const Material *material) :
-        Object(material), _center(center), _radius(radius) {}
+        Object(material), _center(center), _radius(radius),
+        _packed(pack()) {}
 
-    std::optional<Intersection> find_intersection(const Ray &r) const;
+    const Packed<double> &packed() const { return _packed; }
+
+    // Distance along the ray to the nearest hit in front of its origin and
+    // closer than t_max, or infinity.
+    template <typename T>
+    static T distance(const Packed<T> &s, const simd::vec3<T> &origin,
+            const simd::vec3<T> &direction, T t_max);
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    std::optional<BoundingBox> bounds() const;
+
+private:
+    Packed<double> _packed;
+
+    Packed<double> pack() const;
 };
 
 class Plane : public Object
 {
-    glm::dvec3 _normal;
-    glm::dvec3 _point;
+    svec3 _normal;
+    svec3 _point;
 
 public:
-    Plane(const glm::dvec3 &normal, const glm::dvec3 &point,
+    // The plane as dot(normal, x) + offset = 0.
+    template <typename T>
+    struct Packed
+    {
+        simd::vec3<T> normal;
+        T offset;
+
+        void set(size_t lane, const Packed<double> &p)
+        {
+            simd::set(normal, lane, p.normal);
+            simd::set(offset, lane, p.offset);
+        }
+    };
+
+    Plane(const svec3 &normal, const svec3 &point,
             const Material *material) :
-        Object(material), _normal(normal), _point(point) {}
+        Object(material), _normal(normal), _point(point),
+        _packed(pack()) {}
 
-    std::optional<Intersection> find_intersection(const Ray &r) const;
+    const Packed<double> &packed() const { return _packed; }
+
+    template <typename T>
+    static T distance(const Packed<T> &p, const simd::vec3<T> &origin,
+            const simd::vec3<T> &direction, T t_max);
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+
+private:
+    Packed<double> _packed;
+
+    Packed<double> pack() const;
 };
 
 struct Vertex
 {
-    glm::dvec3 position;
-    glm::dvec3 normal;
+    svec3 position;
+    svec3 normal;
 };
 
 struct Triangle
@@ -87,38 +197,532 @@ struct Triangle
 class Mesh : public Object
 {
     std::vector<Vertex> _vertices;
-    std::vector<Triangle> _triangles;
+    BVHOptions _bvh_options;
+    double _built_sah_cost = 0.0d;
     BVH<Triangle> _bvh;
+    WideBVH<4> _bvh_4;
+    WideBVH<8> _bvh_8;
+    WideBVH<4, true> _bvh_4_quantized;
+    WideBVH<8, true> _bvh_8_quantized;
+    TriangleBlocks _triangle_blocks;
 
 public:
     Mesh(std::vector<Vertex> vertices, std::vector<Triangle> triangles,
-            const Material *material) :
+            const Material *material,
+            const BVHOptions &bvh_options = BVHOptions()) :
         Object(material), _vertices(std::move(vertices)),
-        _triangles(triangles) { regen_bvh(100); }
+        _bvh_options(bvh_options) { regen_bvh(std::move(triangles)); }
 
-    std::optional<Intersection> find_intersection(const Ray &r) const;
-    std::optional<Intersection> find_intersection(const Ray &r,
-        const Triangle &t) const;
+    const std::vector<Vertex> &vertices() const { return _vertices; }
+    const BVH<Triangle> &bvh() const { return _bvh; }
+    double bvh_sah_cost() const;
+    // Everything kept for tracing: the wide BVH, or the binary one when
+    // the mesh is traced with it, and the triangle blocks.
+    size_t bvh_memory() const;
+    const std::vector<Triangle> &triangles() const
+    {
+        return _bvh.objects();
+    }
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    bool occluded(const Ray &r, double t_max) const;
+    std::optional<BoundingBox> bounds() const;
+
+    enum Update
+    {
+        REFIT,
+        REBUILT,
+        REJECTED
+    };
+
+    // Replaces the vertices, keeping the triangles. The BVH and the
+    // triangle blocks are refit in place, or rebuilt when refitting has
+    // raised the SAH cost above BVHOptions::refit_threshold times the
+    // cost after the last build. Vertices of a different number are
+    // rejected and the mesh is left as it was.
+    Update update_vertices(std::vector<Vertex> vertices);
 
 private:
+    // The cache stores the built structures as they are and restores them
+    // into a mesh made by this constructor.
+    friend class MeshCache;
+
+    Mesh(const Material *material, const BVHOptions &bvh_options) :
+        Object(material), _bvh_options(bvh_options) {}
+
     BoundingBox calculate_box(const Triangle &t) const;
-    void regen_bvh(size_t delta);
+    BoundingBox clip_box(const Triangle &t, int axis, float lo, float hi)
+        const;
+    void regen_bvh(std::vector<Triangle> triangles);
+    void collapse_bvh();
+
+    template <typename TFn>
+    void for_each_leaf(const TFn &fn) const;
+
+    template <typename TFn>
+    bool with_wide_bvh(const TFn &fn) const;
 };
 
+template <typename TFn>
+bool Mesh::with_wide_bvh(const TFn &fn) const
+{
+    if (!_bvh_4.empty())
+    {
+        fn(_bvh_4);
+    }
+    else if (!_bvh_8.empty())
+    {
+        fn(_bvh_8);
+    }
+    else if (!_bvh_4_quantized.empty())
+    {
+        fn(_bvh_4_quantized);
+    }
+    else if (!_bvh_8_quantized.empty())
+    {
+        fn(_bvh_8_quantized);
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Fills u and v so that with the unit vector n they form an orthonormal
+// frame, without branches (Duff et al., "Building an Orthonormal Basis,
+// Revisited").
+void orthonormal_basis(const glm::dvec3 &n, glm::dvec3 &u, glm::dvec3 &v);
+
 class Cylinder : public Object
 {
-    glm::dvec3 _bottom_center;
-    glm::dvec3 _axis;
-    double _radius;
-    double _height;
+    svec3 _bottom_center;
+    svec3 _axis;
+    scalar _radius;
+    scalar _height;
 
 public:
-    Cylinder(const glm::dvec3 &bottom_center, const glm::dvec3 &axis,
-            double radius, double height, const Material *material) :
-        Object(material), _bottom_center(bottom_center), _axis(axis),
-        _radius(radius), _height(height) {}
+    // The local frame of the cylinder: the bottom center as origin, two
+    // unit vectors across the axis and the (unit) axis itself.
+    template <typename T>
+    struct Packed
+    {
+        simd::vec3<T> bottom_center;
+        simd::vec3<T> u;
+        simd::vec3<T> v;
+        simd::vec3<T> axis;
+        T radius;
+        T height;
 
-    std::optional<Intersection> find_intersection(const Ray &r) const;
+        void set(size_t lane, const Packed<double> &c)
+        {
+            simd::set(bottom_center, lane, c.bottom_center);
+            simd::set(u, lane, c.u);
+            simd::set(v, lane, c.v);
+            simd::set(axis, lane, c.axis);
+            simd::set(radius, lane, c.radius);
+            simd::set(height, lane, c.height);
+        }
+    };
+
+    // The axis is normalized here, and the frame built once for the
+    // kernel.
+    Cylinder(const svec3 &bottom_center, const svec3 &axis,
+            scalar radius, scalar height, const Material *material) :
+        Object(material), _bottom_center(bottom_center),
+        _axis(glm::normalize(axis)), _radius(radius), _height(height),
+        _packed(pack()) {}
+
+    const Packed<double> &packed() const { return _packed; }
+
+    template <typename T>
+    static T distance(const Packed<T> &c, const simd::vec3<T> &origin,
+            const simd::vec3<T> &direction, T t_max);
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    std::optional<BoundingBox> bounds() const;
+
+private:
+    Packed<double> _packed;
+
+    Packed<double> pack() const;
+};
+
+// A parallelogram spanned by two edges from a corner. The kernel tests the
+// plane, then the coordinates of the point along the edges, which are dot
+// products with the precomputed dual vectors of the edges.
+class Quad : public Object
+{
+    svec3 _corner;
+    svec3 _edge_u;
+    svec3 _edge_v;
+    svec3 _normal;
+
+public:
+    template <typename T>
+    struct Packed
+    {
+        simd::vec3<T> corner;
+        simd::vec3<T> normal;
+        simd::vec3<T> dual_u;
+        simd::vec3<T> dual_v;
+
+        void set(size_t lane, const Packed<double> &q)
+        {
+            simd::set(corner, lane, q.corner);
+            simd::set(normal, lane, q.normal);
+            simd::set(dual_u, lane, q.dual_u);
+            simd::set(dual_v, lane, q.dual_v);
+        }
+    };
+
+    Quad(const svec3 &corner, const svec3 &edge_u, const svec3 &edge_v,
+            const Material *material) :
+        Object(material), _corner(corner), _edge_u(edge_u),
+        _edge_v(edge_v),
+        _normal(glm::normalize(glm::cross(edge_u, edge_v))),
+        _packed(pack()) {}
+
+    double area() const { return glm::length(glm::cross(_edge_u, _edge_v)); }
+    const Packed<double> &packed() const { return _packed; }
+
+    template <typename T>
+    static T distance(const Packed<T> &q, const simd::vec3<T> &origin,
+            const simd::vec3<T> &direction, T t_max);
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    std::optional<BoundingBox> bounds() const;
+    std::optional<SurfaceSample> sample(const glm::dvec2 &u) const;
+
+private:
+    Packed<double> _packed;
+
+    Packed<double> pack() const;
+};
+
+// A disk given by its center, normal and radius. The frame in its plane is
+// kept for sampling.
+class Disk : public Object
+{
+    svec3 _center;
+    svec3 _normal;
+    svec3 _u;
+    svec3 _v;
+    scalar _radius;
+
+public:
+    template <typename T>
+    struct Packed
+    {
+        simd::vec3<T> center;
+        simd::vec3<T> normal;
+        T radius;
+
+        void set(size_t lane, const Packed<double> &d)
+        {
+            simd::set(center, lane, d.center);
+            simd::set(normal, lane, d.normal);
+            simd::set(radius, lane, d.radius);
+        }
+    };
+
+    Disk(const svec3 &center, const svec3 &normal, scalar radius,
+            const Material *material) :
+        Object(material), _center(center), _normal(glm::normalize(normal)),
+        _radius(radius), _packed(pack())
+    {
+        glm::dvec3 u;
+        glm::dvec3 v;
+
+        orthonormal_basis(_normal, u, v);
+        _u = u;
+        _v = v;
+    }
+
+    double area() const { return std::acos(-1.0d) * _radius * _radius; }
+    const Packed<double> &packed() const { return _packed; }
+
+    template <typename T>
+    static T distance(const Packed<T> &d, const simd::vec3<T> &origin,
+            const simd::vec3<T> &direction, T t_max);
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    std::optional<BoundingBox> bounds() const;
+    std::optional<SurfaceSample> sample(const glm::dvec2 &u) const;
+
+private:
+    Packed<double> _packed;
+
+    Packed<double> pack() const;
+};
+
+// A box with its own orthonormal frame, given by its center, the axes of
+// the frame and the half extents along them. Rays are moved into the frame
+// and clipped against its three slabs; from inside a box, the far side is
+// hit, so a box also serves as the walls of a room.
+class Box : public Object
+{
+    svec3 _center;
+    smat3 _axes;
+    svec3 _half_extent;
+
+public:
+    template <typename T>
+    struct Packed
+    {
+        simd::vec3<T> center;
+        simd::vec3<T> axes[3];
+        simd::vec3<T> half_extent;
+
+        void set(size_t lane, const Packed<double> &b)
+        {
+            simd::set(center, lane, b.center);
+
+            for (int i = 0; i < 3; ++i)
+            {
+                simd::set(axes[i], lane, b.axes[i]);
+            }
+
+            simd::set(half_extent, lane, b.half_extent);
+        }
+    };
+
+    // The axes are the columns of a rotation.
+    Box(const svec3 &center, const smat3 &axes, const svec3 &half_extent,
+            const Material *material) :
+        Object(material), _center(center), _axes(axes),
+        _half_extent(half_extent), _packed(pack()) {}
+    Box(const svec3 &min, const svec3 &max, const Material *material) :
+        Box((min + max) / scalar(2), smat3(1), (max - min) / scalar(2),
+            material) {}
+
+    double area() const;
+    const Packed<double> &packed() const { return _packed; }
+
+    template <typename T>
+    static T distance(const Packed<T> &b, const simd::vec3<T> &origin,
+            const simd::vec3<T> &direction, T t_max);
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    std::optional<BoundingBox> bounds() const;
+    std::optional<SurfaceSample> sample(const glm::dvec2 &u) const;
+
+private:
+    Packed<double> _packed;
+
+    Packed<double> pack() const;
+};
+
+class Instance : public Object
+{
+    std::shared_ptr<const Mesh> _mesh;
+    glm::dmat4 _transform;
+    glm::dmat4 _inverse;
+    smat3 _normal_matrix;
+
+public:
+    Instance(std::shared_ptr<const Mesh> mesh, const glm::dmat4 &transform,
+            const Material *material) :
+        Object(material), _mesh(std::move(mesh)), _transform(transform),
+        _inverse(glm::inverse(transform)),
+        _normal_matrix(glm::transpose(glm::dmat3(_inverse))) {}
+
+    const std::shared_ptr<const Mesh> &mesh() const { return _mesh; }
+    const glm::dmat4 &transform() const { return _transform; }
+
+    bool intersect(const Ray &r, Hit &hit) const;
+    Intersection intersection(const Ray &r, const Hit &hit) const;
+    bool occluded(const Ray &r, double t_max) const;
+    std::optional<BoundingBox> bounds() const;
+
+private:
+    Ray to_object(const Ray &r) const;
 };
 
-#endif // OBJECT_H
+// The kernels are solved in double in both builds: for large spheres the
+// constant term |l|^2 - r^2 cancels catastrophically in float. Conditions
+// select lane results instead of branching, so a pack of primitives runs
+// the same instructions as one, and a pack returns early only when all of
+// its lanes miss.
+//
+// The sphere kernel follows "Precision Improvements for Ray/Sphere
+// Intersection" (Ray Tracing Gems, chapter 7). The discriminant is taken
+// from the distance between the center and the ray's line rather than as
+// b^2 - ac, which loses most of its digits for the 1e5 radius walls of
+// scene 2, and the roots are c / q and q / a, so that neither subtracts
+// nearly equal values. The direction need not be normalized: the renderer
+// passes a zero one after total internal reflection, which misses.
+template <typename T>
+T Sphere::distance(const Packed<T> &s, const simd::vec3<T> &origin,
+        const simd::vec3<T> &direction, T t_max)
+{
+    const T infinity = simd::splat<T>(std::numeric_limits<double>::infinity());
+    simd::vec3<T> l = origin - s.center;
+    T a = simd::dot(direction, direction);
+    T b = simd::dot(direction, l);
+    T c = simd::dot(l, l) - s.radius * s.radius;
+    simd::vec3<T> f = l - direction * (b / a);
+    T e = s.radius * s.radius - simd::dot(f, f);
+
+    // A lane drops out when the line misses the sphere, or when the origin
+    // is outside and the sphere behind it.
+    auto candidate = (e >= 0) & ((c <= 0) | (b < 0));
+
+    if (!simd::any(candidate))
+    {
+        return infinity;
+    }
+
+    T root = simd::sqrt(a * simd::max(e, simd::splat<T>(0.0d)));
+    T q = -(b + simd::select(b < 0, -root, root));
+    T t_0 = c / q;
+    T t_1 = q / a;
+    T near = simd::min(t_0, t_1);
+    T far = simd::max(t_0, t_1);
+    T t = simd::select(near < 0, far, near);
+
+    return simd::select(candidate & (t >= 0) & (t < t_max), t, infinity);
+}
+
+template <typename T>
+T Plane::distance(const Packed<T> &p, const simd::vec3<T> &origin,
+        const simd::vec3<T> &direction, T t_max)
+{
+    T denominator = simd::dot(direction, p.normal);
+    T t = -(p.offset + simd::dot(origin, p.normal)) / denominator;
+
+    return simd::select((simd::abs(denominator) < 1e-3d) | (t < 0) |
+        (t >= t_max), simd::splat<T>(std::numeric_limits<double>::infinity()),
+        t);
+}
+
+// The ray is moved into the local frame, where the cylinder is x^2 + y^2
+// <= r^2 between the cap planes z = 0 and z = h. The solid is the overlap
+// of the interval where the ray is inside the infinite cylinder (one
+// quadratic) and the interval between the cap planes, so the nearest hit
+// is the start of the overlap, or its end for an origin inside. The frame
+// is a rotation, so distances need no rescaling.
+template <typename T>
+T Cylinder::distance(const Packed<T> &c, const simd::vec3<T> &origin,
+        const simd::vec3<T> &direction, T t_max)
+{
+    const T infinity = simd::splat<T>(std::numeric_limits<double>::infinity());
+    simd::vec3<T> delta = origin - c.bottom_center;
+    T o_x = simd::dot(delta, c.u);
+    T o_y = simd::dot(delta, c.v);
+    T o_z = simd::dot(delta, c.axis);
+    T d_x = simd::dot(direction, c.u);
+    T d_y = simd::dot(direction, c.v);
+    T d_z = simd::dot(direction, c.axis);
+
+    T a = d_x * d_x + d_y * d_y;
+    T b = o_x * d_x + o_y * d_y;
+    T e = o_x * o_x + o_y * o_y - c.radius * c.radius;
+    T discriminant = b * b - a * e;
+
+    // A ray along the axis stays inside or outside the side for all t.
+    auto along = a == 0;
+    auto side = (along & (e <= 0)) | ((a > 0) & (discriminant >= 0));
+
+    if (!simd::any(side))
+    {
+        return infinity;
+    }
+
+    T root = simd::sqrt(simd::max(discriminant, simd::splat<T>(0.0d)));
+    T side_near = simd::select(along, -infinity, (-b - root) / a);
+    T side_far = simd::select(along, infinity, (-b + root) / a);
+
+    T inv_d_z = 1.0d / d_z;
+    T t_bottom = -o_z * inv_d_z;
+    T t_top = (c.height - o_z) * inv_d_z;
+    auto across = d_z == 0;
+    auto between = (o_z > 0) & (o_z < c.height);
+    T cap_near = simd::select(across,
+        simd::select(between, -infinity, infinity),
+        simd::min(t_bottom, t_top));
+    T cap_far = simd::select(across,
+        simd::select(between, infinity, -infinity),
+        simd::max(t_bottom, t_top));
+
+    T near = simd::max(side_near, cap_near);
+    T far = simd::min(side_far, cap_far);
+    T t = simd::select(near >= 0, near, far);
+
+    return simd::select(side & (near <= far) & (t >= 0) & (t < t_max), t,
+        infinity);
+}
+
+// Hits of the flat kernels closer than this are taken for the surface the
+// ray starts on, which a flat surface cannot hit again.
+constexpr double surface_epsilon = 1e-6d;
+
+template <typename T>
+T Quad::distance(const Packed<T> &q, const simd::vec3<T> &origin,
+        const simd::vec3<T> &direction, T t_max)
+{
+    simd::vec3<T> delta = origin - q.corner;
+    T denominator = simd::dot(direction, q.normal);
+    T t = -simd::dot(delta, q.normal) / denominator;
+    simd::vec3<T> p = delta + direction * t;
+    T u = simd::dot(p, q.dual_u);
+    T v = simd::dot(p, q.dual_v);
+
+    return simd::select((t > surface_epsilon) & (t < t_max) & (u >= 0) &
+        (u <= 1) & (v >= 0) & (v <= 1), t,
+        simd::splat<T>(std::numeric_limits<double>::infinity()));
+}
+
+template <typename T>
+T Disk::distance(const Packed<T> &d, const simd::vec3<T> &origin,
+        const simd::vec3<T> &direction, T t_max)
+{
+    simd::vec3<T> delta = origin - d.center;
+    T denominator = simd::dot(direction, d.normal);
+    T t = -simd::dot(delta, d.normal) / denominator;
+    simd::vec3<T> p = delta + direction * t;
+
+    return simd::select((t > surface_epsilon) & (t < t_max) &
+        (simd::dot(p, p) <= d.radius * d.radius), t,
+        simd::splat<T>(std::numeric_limits<double>::infinity()));
+}
+
+template <typename T>
+T Box::distance(const Packed<T> &b, const simd::vec3<T> &origin,
+        const simd::vec3<T> &direction, T t_max)
+{
+    const T infinity = simd::splat<T>(std::numeric_limits<double>::infinity());
+    simd::vec3<T> delta = origin - b.center;
+    const T half_extent[3] =
+    {
+        b.half_extent.x,
+        b.half_extent.y,
+        b.half_extent.z
+    };
+    T near = -infinity;
+    T far = infinity;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        T o = simd::dot(delta, b.axes[i]);
+        T inv_d = 1.0d / simd::dot(direction, b.axes[i]);
+        T t_0 = (-half_extent[i] - o) * inv_d;
+        T t_1 = (half_extent[i] - o) * inv_d;
+
+        near = simd::max(near, simd::min(t_0, t_1));
+        far = simd::min(far, simd::max(t_0, t_1));
+    }
+
+    T t = simd::select(near > surface_epsilon, near, far);
+
+    return simd::select((near <= far) & (t > surface_epsilon) & (t < t_max),
+        t, infinity);
+}
+
+#endif // OBJECT_H
\ No newline at end of file
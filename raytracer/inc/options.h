@@ -6,6 +6,8 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
+#include "bvh.h"
+
 struct Options
 {
     glm::dvec3 camera_origin;
@@ -17,6 +19,7 @@ struct Options
     unsigned num_threads;
     unsigned scene_num;
     std::string out_path;
+    BVHOptions bvh;
 };
 
 #endif // OPTIONS_H
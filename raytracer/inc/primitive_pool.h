@@ -0,0 +1,163 @@
+#ifndef PRIMITIVE_POOL_H
+#define PRIMITIVE_POOL_H
+
+#include <algorithm>
+#include <vector>
+
+#include "ray.h"
+#include "object.h"
+#include "simd.h"
+
+// A ray broadcast to every lane, once per query.
+struct PackedRay
+{
+    simd::vec3<simd::dlanes> origin;
+    simd::vec3<simd::dlanes> direction;
+
+    explicit PackedRay(const Ray &r) :
+        origin(simd::splat<simd::dlanes>(r.origin())),
+        direction(simd::splat<simd::dlanes>(glm::dvec3(r.direction()))) {}
+};
+
+// Primitives of one type (Sphere, Cylinder, Plane, Quad, Disk or Box)
+// gathered into structure-of-arrays blocks of simd::width, so that a ray
+// is tested against a whole block by one call of the type's distance
+// kernel instead of a virtual call per object. The objects stay owned by
+// the scene; hits refer to them, so materials and Object::intersection
+// apply unchanged.
+//
+// Slots may be left empty (null) so that a range of primitives tested
+// together, such as those of a BVH leaf, starts a new block; empty slots
+// are never inside a tested range.
+template <typename TObject>
+class PrimitivePool
+{
+public:
+    using Block = typename TObject::template Packed<simd::dlanes>;
+
+private:
+    std::vector<Block> _blocks;
+    std::vector<const TObject *> _objects;
+    size_t _size = 0;
+
+public:
+    // Slot i holds objects()[i].
+    const std::vector<const TObject *> &objects() const { return _objects; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    static PrimitivePool build(std::vector<const TObject *> objects)
+    {
+        PrimitivePool pool;
+
+        pool._objects = std::move(objects);
+        pool._size = pool._objects.size() - std::count(pool._objects.begin(),
+            pool._objects.end(), nullptr);
+        pool._blocks.resize((pool._objects.size() + simd::width - 1) /
+            simd::width);
+
+        // Lanes of empty slots and past the last object repeat an object of
+        // their block; their results are ignored. Zero lanes would not do:
+        // a zero cylinder holds every ray inside its radius, so a kernel
+        // could never return early for a block that has one.
+        for (size_t b = 0; b < pool._blocks.size(); ++b)
+        {
+            size_t first = b * simd::width;
+            size_t last = std::min(first + simd::width, pool._objects.size());
+            auto filler = std::find_if(pool._objects.begin() + first,
+                pool._objects.begin() + last,
+                [](const TObject *o) { return o != nullptr; });
+
+            for (size_t lane = 0; lane < simd::width; ++lane)
+            {
+                size_t i = first + lane;
+                const TObject *o = (i < last) ? pool._objects[i] : nullptr;
+
+                if (!o && filler != pool._objects.begin() + last)
+                {
+                    o = *filler;
+                }
+
+                pool._blocks[b].set(lane, o ? o->packed() :
+                    typename TObject::template Packed<double>());
+            }
+        }
+
+        return pool;
+    }
+
+    // Records the nearest hit closer than hit.distance among the slots
+    // [first, first + count), or among all of them in a pool built without
+    // empty slots.
+    bool intersect(const PackedRay &r, size_t first, size_t count,
+            Hit &hit) const
+    {
+        bool found = false;
+
+        for_each_distance(r, first, count, hit.distance,
+            [&](size_t i, double t)
+            {
+                if (t < hit.distance)
+                {
+                    hit.distance = t;
+                    hit.primitive = i;
+                    hit.object = _objects[i];
+                    found = true;
+                }
+
+                return false;
+            });
+
+        return found;
+    }
+
+    bool intersect(const PackedRay &r, Hit &hit) const
+    {
+        return intersect(r, 0, _objects.size(), hit);
+    }
+
+    bool occluded(const PackedRay &r, size_t first, size_t count,
+            double t_max) const
+    {
+        return for_each_distance(r, first, count, t_max,
+            [&](size_t, double t)
+            {
+                return t < t_max;
+            });
+    }
+
+    bool occluded(const PackedRay &r, double t_max) const
+    {
+        return occluded(r, 0, _objects.size(), t_max);
+    }
+
+private:
+    // Calls fn(slot, distance) for the slots of the range until it returns
+    // true. Blocks are tested against t_max, which fn may lower.
+    template <typename TFn>
+    bool for_each_distance(const PackedRay &r, size_t first, size_t count,
+            const double &t_max, const TFn &fn) const
+    {
+        size_t end = first + count;
+
+        for (size_t b = first / simd::width; b * simd::width < end; ++b)
+        {
+            simd::dlanes t = TObject::distance(_blocks[b], r.origin,
+                r.direction, simd::splat<simd::dlanes>(t_max));
+            size_t i = std::max(first, b * simd::width);
+            size_t last = std::min(end, (b + 1) * simd::width);
+
+            for (; i < last; ++i)
+            {
+                if (fn(i, t[i % simd::width]))
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+};
+
+#endif // PRIMITIVE_POOL_H
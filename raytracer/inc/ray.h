@@ -2,18 +2,37 @@
 #define RAY_H
 
 #include <glm/vec3.hpp>
+#include <glm/common.hpp>
+#include <glm/vector_relational.hpp>
+
+#include "scalar.h"
 
 class Ray
 {
     glm::dvec3 _origin;
-    glm::dvec3 _direction;
+    svec3 _direction;
+    glm::vec3 _box_origin;
+    glm::vec3 _inv_direction;
+    glm::uvec3 _sign;
 
 public:
-    Ray(const glm::dvec3 &origin, const glm::dvec3 &direction) :
-        _origin(origin), _direction(direction) {}
+    Ray(const glm::dvec3 &origin, const svec3 &direction) :
+        _origin(origin), _direction(direction),
+        _box_origin(origin), _inv_direction(1.0d / glm::dvec3(direction)),
+        _sign(_inv_direction.x < 0, _inv_direction.y < 0,
+            _inv_direction.z < 0) {}
 
     const glm::dvec3 &origin() const { return _origin; }
-    const glm::dvec3 &direction() const { return _direction; }
+    const svec3 &direction() const { return _direction; }
+    const glm::vec3 &box_origin() const { return _box_origin; }
+    const glm::vec3 &inv_direction() const { return _inv_direction; }
+    const glm::uvec3 &sign() const { return _sign; }
+
+    bool degenerate() const
+    {
+        return glm::any(glm::isnan(_box_origin)) ||
+            glm::any(glm::isnan(_inv_direction));
+    }
 };
 
 #endif // RAY_H
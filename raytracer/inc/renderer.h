@@ -22,8 +22,13 @@ private:
         const Options &options, const glm::uvec2 &supersample) const;
     glm::dvec3 render_ray(const Scene &scene, const Ray &ray,
         unsigned recursion = 0, unsigned max_recursion = 5) const;
+    // Emission of a light hit is left out when count_emission is false,
+    // after a diffuse bounce that already sampled the lights directly.
     glm::dvec3 render_path(const Scene &scene, const Ray &ray,
-        unsigned recursion = 0, unsigned max_recursion = 5) const;
+        unsigned recursion = 0, unsigned max_recursion = 5,
+        bool count_emission = true) const;
+    glm::dvec3 sample_lights(const Scene &scene, const Intersection &i,
+        const glm::dvec3 &n) const;
 
     glm::dvec3 reflect(const glm::dvec3 &indice, const glm::dvec3 &normal)
         const;
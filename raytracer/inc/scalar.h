@@ -0,0 +1,24 @@
+#ifndef SCALAR_H
+#define SCALAR_H
+
+#include <glm/vec3.hpp>
+#include <glm/mat3x3.hpp>
+
+// Scalar type of the geometry: ray directions, vertices, normals and the
+// parameters of primitives. It is double unless built with
+// RT_SINGLE_PRECISION, which halves the size of vertices and rays. Ray
+// origins and hit points stay in double in both builds: secondary rays
+// start 1e-3 off the surface, an offset that float no longer resolves some
+// thousands of units away from the origin, so primitives subtract the
+// origin in double and only narrow the difference. Triangle blocks, which
+// stay in float, subtract it as a float and its float remainder.
+#ifdef RT_SINGLE_PRECISION
+using scalar = float;
+#else
+using scalar = double;
+#endif
+
+using svec3 = glm::vec<3, scalar>;
+using smat3 = glm::mat<3, 3, scalar>;
+
+#endif // SCALAR_H
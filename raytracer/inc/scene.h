@@ -10,11 +10,50 @@
 #include "ray.h"
 #include "object.h"
 #include "light.h"
+#include "bvh.h"
+#include "primitive_pool.h"
+
+// Entry of the scene BVH: a sphere, cylinder, quad, disk or box by its slot
+// in the pool of its type, or another bounded object. Leaves dispatch on
+// the tag rather than through virtual calls, and the entries of a leaf are
+// sorted by it so that its primitives of each type are ranges tested block
+// by block.
+struct PrimitiveRef
+{
+    enum Type : uint32_t
+    {
+        SPHERE,
+        CYLINDER,
+        QUAD,
+        DISK,
+        BOX,
+        OBJECT
+    };
+
+    Type type;
+    uint32_t index;
+};
 
 class Scene
 {
+    // Scenes with up to this many bounded objects keep them in one leaf.
+    static constexpr size_t max_flat_objects = 8;
+
     std::vector<std::unique_ptr<Object>> _objects;
     std::vector<std::unique_ptr<PointLight>> _point_lights;
+    PrimitivePool<Sphere> _spheres;
+    PrimitivePool<Cylinder> _cylinders;
+    PrimitivePool<Plane> _planes;
+    PrimitivePool<Quad> _quads;
+    PrimitivePool<Disk> _disks;
+    PrimitivePool<Box> _boxes;
+    std::vector<const Object *> _bounded;
+    BVH<PrimitiveRef> _bvh;
+    // Set when the bounded objects are kept in a single leaf. Their pools
+    // then hold no empty slots and are tested whole.
+    bool _flat = false;
+    std::vector<const Object *> _unbounded;
+    std::vector<const Object *> _lights;
 
 public:
     std::vector<std::unique_ptr<Object>> &objects()
@@ -37,7 +76,36 @@ public:
         return _point_lights;
     }
 
+    const PrimitivePool<Sphere> &spheres() const { return _spheres; }
+    const PrimitivePool<Cylinder> &cylinders() const { return _cylinders; }
+    const PrimitivePool<Plane> &planes() const { return _planes; }
+    const PrimitivePool<Quad> &quads() const { return _quads; }
+    const PrimitivePool<Disk> &disks() const { return _disks; }
+    const PrimitivePool<Box> &boxes() const { return _boxes; }
+    const BVH<PrimitiveRef> &bvh() const { return _bvh; }
+    const std::vector<const Object *> &unbounded() const
+    {
+        return _unbounded;
+    }
+
+    // Emissive objects whose surface can be sampled, for next event
+    // estimation. They are also flagged with Object::light.
+    const std::vector<const Object *> &lights() const { return _lights; }
+
+    // Builds the BVH over the bounded objects, a single leaf for a few of
+    // them, and gathers the primitives into their pools, all but planes in
+    // leaf order. Also collects the lights.
+    void build_bvh(const BVHOptions &options);
+    void refit_bvh();
+
     std::optional<Intersection> find_intersection(const Ray &ray) const;
+    bool occluded(const Ray &ray, double t_max) const;
+
+private:
+    const Object *object(const PrimitiveRef &p) const;
+
+    template <typename TFn>
+    bool for_each_run(uint32_t offset, uint32_t count, const TFn &fn) const;
 };
 
 #endif // SCENE_H
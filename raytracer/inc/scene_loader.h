@@ -6,9 +6,12 @@
 
 #include "scene.h"
 #include "material.h"
+#include "bvh.h"
 
 class SceneLoader
 {
+    BVHOptions _bvh_options;
+
     Material _ivory = Material(glm::dvec3(0.4, 0.4, 0.3),
         glm::dvec3(0.0), glm::dvec4(0.6, 0.3, 0.1, 0.0),
         50.0d, 1.0d, Material::DIFFUSE);
@@ -35,28 +38,53 @@ class SceneLoader
         125.0d, 1.5d, Material::REFRACTIVE);
 
 public:
+    SceneLoader(const BVHOptions &bvh_options = BVHOptions()) :
+        _bvh_options(bvh_options) {}
+
     std::unique_ptr<Scene> load_scene(unsigned number)
     {
+        std::unique_ptr<Scene> scene;
+
         switch(number)
         {
             case 1:
-                return scene_1();
+                scene = scene_1();
+                break;
 
             case 2:
-                return scene_2();
+                scene = scene_2();
+                break;
 
             case 3:
-                return scene_3();
+                scene = scene_3();
+                break;
+
+            case 4:
+                scene = scene_4();
+                break;
+
+            case 5:
+                scene = scene_5();
+                break;
 
             default:
                 return nullptr;
         }
+
+        if (scene)
+        {
+            scene->build_bvh(_bvh_options);
+        }
+
+        return scene;
     }
 
 private:
     std::unique_ptr<Scene> scene_1();
     std::unique_ptr<Scene> scene_2();
     std::unique_ptr<Scene> scene_3();
+    std::unique_ptr<Scene> scene_4();
+    std::unique_ptr<Scene> scene_5();
 };
 
 #endif // SCENE_LOADER_H
@@ -0,0 +1,182 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstddef>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include <glm/vec3.hpp>
+
+// Packs of double lanes as wide as the vector registers: 4 with AVX, 2 with
+// SSE2 and 1 otherwise. A pack is a GCC vector extension type, so
+// arithmetic applies lane by lane, comparisons yield lane masks and the
+// conditional operator selects by mask. With the overloads below, one
+// kernel template tests a single primitive (T = double) or a pack of them
+// (T = simd::dlanes) with the same operations, and thus the same results.
+// Kernels combine conditions with & and | rather than && and ||.
+namespace simd
+{
+#if defined(__AVX__)
+constexpr size_t width = 4;
+#elif defined(__SSE2__)
+constexpr size_t width = 2;
+#else
+constexpr size_t width = 1;
+#endif
+
+typedef double dlanes __attribute__((vector_size(width * sizeof(double))));
+typedef decltype(dlanes{} < dlanes{}) dmask;
+
+template <typename T>
+struct vec3
+{
+    T x;
+    T y;
+    T z;
+};
+
+template <typename T>
+inline T splat(double x);
+
+template <>
+inline double splat<double>(double x)
+{
+    return x;
+}
+
+template <>
+inline dlanes splat<dlanes>(double x)
+{
+#if defined(__AVX__)
+    return _mm256_set1_pd(x);
+#elif defined(__SSE2__)
+    return _mm_set1_pd(x);
+#else
+    return dlanes{x};
+#endif
+}
+
+template <typename T>
+inline vec3<T> splat(const glm::dvec3 &v)
+{
+    return { splat<T>(v.x), splat<T>(v.y), splat<T>(v.z) };
+}
+
+inline double sqrt(double x)
+{
+    return std::sqrt(x);
+}
+
+inline dlanes sqrt(dlanes x)
+{
+#if defined(__AVX__)
+    return _mm256_sqrt_pd(x);
+#elif defined(__SSE2__)
+    return _mm_sqrt_pd(x);
+#else
+    return dlanes{std::sqrt(x[0])};
+#endif
+}
+
+// Whether any lane of a mask is set, for early exits of whole packs.
+inline bool any(bool mask)
+{
+    return mask;
+}
+
+inline bool any(dmask mask)
+{
+#if defined(__AVX__)
+    return _mm256_movemask_pd((__m256d) mask) != 0;
+#elif defined(__SSE2__)
+    return _mm_movemask_pd((__m128d) mask) != 0;
+#else
+    return mask[0] != 0;
+#endif
+}
+
+template <typename TMask, typename T>
+inline T select(TMask mask, T a, T b)
+{
+    return mask ? a : b;
+}
+
+template <typename TMask, typename T>
+inline vec3<T> select(TMask mask, const vec3<T> &a, const vec3<T> &b)
+{
+    return { mask ? a.x : b.x, mask ? a.y : b.y, mask ? a.z : b.z };
+}
+
+template <typename T>
+inline T min(T a, T b)
+{
+    return a < b ? a : b;
+}
+
+template <typename T>
+inline T max(T a, T b)
+{
+    return a > b ? a : b;
+}
+
+template <typename T>
+inline T abs(T a)
+{
+    return a < 0 ? -a : a;
+}
+
+// Stores x into one lane of a pack; the double overload lets packing code
+// be shared with the single primitive too.
+inline void set(double &pack, size_t, double x)
+{
+    pack = x;
+}
+
+inline void set(dlanes &pack, size_t lane, double x)
+{
+    pack[lane] = x;
+}
+
+template <typename T>
+inline void set(vec3<T> &pack, size_t lane, const vec3<double> &v)
+{
+    set(pack.x, lane, v.x);
+    set(pack.y, lane, v.y);
+    set(pack.z, lane, v.z);
+}
+
+template <typename T>
+inline vec3<T> operator+(const vec3<T> &a, const vec3<T> &b)
+{
+    return { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+template <typename T>
+inline vec3<T> operator-(const vec3<T> &a, const vec3<T> &b)
+{
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+template <typename T>
+inline vec3<T> operator-(const vec3<T> &a)
+{
+    return { -a.x, -a.y, -a.z };
+}
+
+template <typename T>
+inline vec3<T> operator*(const vec3<T> &a, T s)
+{
+    return { a.x * s, a.y * s, a.z * s };
+}
+
+template <typename T>
+inline T dot(const vec3<T> &a, const vec3<T> &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+}
+
+#endif // SIMD_H
@@ -2,6 +2,7 @@
 #define TIMER_H
 
 #include <chrono>
+#include <iomanip>
 #include <iostream>
 
 class Timer
@@ -38,7 +39,8 @@ public:
         multiplier /= 60;
 
         std::cout << us / multiplier << ".";
-        std::cout << us % multiplier << " second(s)";
+        std::cout << std::setw(6) << std::setfill('0') <<
+            us % multiplier << std::setfill(' ') << " second(s)";
     }
 };
 
@@ -0,0 +1,463 @@
+#ifndef TRIANGLE_BLOCKS_H
+#define TRIANGLE_BLOCKS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+#include <glm/vec3.hpp>
+
+#include "ray.h"
+#include "bvh.h"
+#include "mapped_array.h"
+
+// Triangle positions in BVH leaf order, packed in structure-of-arrays
+// blocks of float records so that the triangles of a leaf are tested
+// together with SSE (4 lanes) or AVX (8 lanes). Every leaf starts a new
+// block, so a leaf of up to 4 or 8 triangles takes a single test.
+//
+// The test is the watertight one of Woop, Benthin and Wald: vertices are
+// moved into a space where the ray runs along +z from the origin and the
+// 2D edge functions decide the hit. Vertices rather than edges are stored,
+// so triangles sharing an edge compute identical edge functions for it and
+// no ray passes between them.
+class TriangleBlocks
+{
+public:
+#if defined(__AVX__)
+    static constexpr size_t width = 8;
+#else
+    static constexpr size_t width = 4;
+#endif
+
+    struct alignas(4 * width) Block
+    {
+        // Indexed by vertex, axis and lane.
+        float v[3][3][width];
+        uint32_t index[width];
+    };
+
+    // Per-ray constants of the transform into ray space.
+    struct Shear
+    {
+        int kx;
+        int ky;
+        int kz;
+        float sx;
+        float sy;
+        float sz;
+        // The double ray origin as a float and the float remainder;
+        // subtracting both in turn keeps the precision of the origin.
+        glm::vec3 origin;
+        glm::vec3 origin_low;
+    };
+
+    // The nearest hit found so far: ray parameter, index of the triangle
+    // among the BVH objects and the barycentric weights of its second and third
+    // vertices.
+    struct Hit
+    {
+        float t = std::numeric_limits<float>::infinity();
+        uint32_t index = 0;
+        float u = 0.0f;
+        float v = 0.0f;
+    };
+
+private:
+    MappedArray<Block> _blocks;
+    // First block of the leaf whose objects start at a given offset.
+    MappedArray<uint32_t> _first;
+
+public:
+    TriangleBlocks() = default;
+    TriangleBlocks(MappedArray<Block> blocks, MappedArray<uint32_t> first) :
+        _blocks(std::move(blocks)), _first(std::move(first)) {}
+
+    const MappedArray<Block> &blocks() const { return _blocks; }
+    const MappedArray<uint32_t> &first() const { return _first; }
+
+    size_t memory() const
+    {
+        return _blocks.size() * sizeof(Block) +
+            _first.size() * sizeof(uint32_t);
+    }
+
+    // for_each_leaf(fn) calls fn(offset, count) for the triangles of every
+    // leaf of the tree the blocks are traced with.
+    template <class TTriangle, class TVertex, typename TLeavesFn>
+    static TriangleBlocks build(const std::vector<TTriangle> &triangles,
+        const std::vector<TVertex> &vertices, const TLeavesFn &for_each_leaf)
+    {
+        std::vector<Block> blocks;
+        std::vector<uint32_t> first(triangles.size(), 0);
+
+        for_each_leaf(
+            [&](uint32_t offset, uint32_t count)
+            {
+                first[offset] = blocks.size();
+
+                // Lanes past the end of the leaf repeat its last triangle,
+                // so that refit can rewrite every lane; the tests mask them
+                // out.
+                for (uint32_t k = 0; k < (count + width - 1) / width * width;
+                    ++k)
+                {
+                    uint32_t index = offset + std::min(k, count - 1);
+
+                    if (k % width == 0)
+                    {
+                        blocks.push_back(Block());
+                    }
+
+                    set_vertices(blocks.back(), k % width, triangles[index],
+                        vertices);
+                    blocks.back().index[k % width] = index;
+                }
+            });
+
+        return TriangleBlocks(std::move(blocks), std::move(first));
+    }
+
+    // Rewrites the vertex positions of the blocks, for meshes whose
+    // vertices have moved while the BVH was only refit.
+    template <class TTriangle, class TVertex>
+    void refit(const std::vector<TTriangle> &triangles,
+        const std::vector<TVertex> &vertices)
+    {
+        long n = _blocks.size();
+
+        #pragma omp parallel for
+        for (long i = 0; i < n; ++i)
+        {
+            for (size_t c = 0; c < width; ++c)
+            {
+                set_vertices(_blocks[i], c, triangles[_blocks[i].index[c]],
+                    vertices);
+            }
+        }
+    }
+
+    static Shear shear(const Ray &r)
+    {
+        glm::dvec3 d = r.direction();
+        glm::dvec3 abs_d = glm::abs(d);
+        Shear s;
+
+        s.kz = (abs_d.x > abs_d.y) ? ((abs_d.x > abs_d.z) ? 0 : 2) :
+            ((abs_d.y > abs_d.z) ? 1 : 2);
+        s.kx = (s.kz + 1) % 3;
+        s.ky = (s.kx + 1) % 3;
+
+        // Keeps the winding, and so the sign of the edge functions, the
+        // same for rays along -z.
+        if (d[s.kz] < 0.0d)
+        {
+            std::swap(s.kx, s.ky);
+        }
+
+        s.sx = d[s.kx] / d[s.kz];
+        s.sy = d[s.ky] / d[s.kz];
+        s.sz = 1.0d / d[s.kz];
+        s.origin = r.box_origin();
+        s.origin_low = glm::vec3(r.origin() - glm::dvec3(s.origin));
+
+        return s;
+    }
+
+    // Tests the triangles of the leaf whose objects are [offset,
+    // offset + count) and records the nearest hit closer than hit.t;
+    // returns whether there was one.
+    bool intersect(const Shear &s, uint32_t offset, uint32_t count,
+        Hit &hit) const
+    {
+        bool found = false;
+        const Block *b = &_blocks[_first[offset]];
+
+        for (uint32_t k = 0; k < count; k += width, ++b)
+        {
+            alignas(4 * width) float t[width];
+            alignas(4 * width) float u[width];
+            alignas(4 * width) float v[width];
+            unsigned mask = intersect_block(s, *b, lanes(count - k),
+                hit.t, t, u, v);
+
+            for (; mask != 0; mask &= mask - 1)
+            {
+                int c = __builtin_ctz(mask);
+
+                if (t[c] < hit.t)
+                {
+                    hit.t = t[c];
+                    hit.index = b->index[c];
+                    hit.u = u[c];
+                    hit.v = v[c];
+                    found = true;
+                }
+            }
+        }
+
+        return found;
+    }
+
+    bool occluded(const Shear &s, uint32_t offset, uint32_t count,
+        float t_max) const
+    {
+        const Block *b = &_blocks[_first[offset]];
+
+        for (uint32_t k = 0; k < count; k += width, ++b)
+        {
+            alignas(4 * width) float t[width];
+            alignas(4 * width) float u[width];
+            alignas(4 * width) float v[width];
+
+            if (intersect_block(s, *b, lanes(count - k), t_max, t, u, v))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    template <class TTriangle, class TVertex>
+    static void set_vertices(Block &b, size_t c, const TTriangle &t,
+        const std::vector<TVertex> &vertices)
+    {
+        const unsigned index[3] = { t.a, t.b, t.c };
+
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                b.v[i][a][c] = vertices[index[i]].position[a];
+            }
+        }
+    }
+
+    // Mask of the lanes in use in a block followed by the given number of
+    // triangles of its leaf, itself included.
+    static unsigned lanes(uint32_t remaining)
+    {
+        return (remaining >= width) ? (1u << width) - 1 :
+            (1u << remaining) - 1;
+    }
+
+    // Full test of one lane. When an edge function rounds to zero the ray
+    // passes through an edge or a vertex, and the edge functions are
+    // recomputed in double so that the neighbouring triangles agree on
+    // which of them is hit.
+    static bool intersect_lane(const Shear &s, const Block &b, size_t c,
+        float t_max, float &t, float &u, float &v)
+    {
+        float x[3];
+        float y[3];
+        float z[3];
+
+        for (int i = 0; i < 3; ++i)
+        {
+            float px = (b.v[i][s.kx][c] - s.origin[s.kx]) -
+                s.origin_low[s.kx];
+            float py = (b.v[i][s.ky][c] - s.origin[s.ky]) -
+                s.origin_low[s.ky];
+            float pz = (b.v[i][s.kz][c] - s.origin[s.kz]) -
+                s.origin_low[s.kz];
+
+            x[i] = px - s.sx * pz;
+            y[i] = py - s.sy * pz;
+            z[i] = s.sz * pz;
+        }
+
+        float e0 = x[2] * y[1] - y[2] * x[1];
+        float e1 = x[0] * y[2] - y[0] * x[2];
+        float e2 = x[1] * y[0] - y[1] * x[0];
+
+        if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)
+        {
+            e0 = double(x[2]) * y[1] - double(y[2]) * x[1];
+            e1 = double(x[0]) * y[2] - double(y[0]) * x[2];
+            e2 = double(x[1]) * y[0] - double(y[1]) * x[0];
+        }
+
+        if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) &&
+            (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f))
+        {
+            return false;
+        }
+
+        float det = e0 + e1 + e2;
+
+        if (det == 0.0f)
+        {
+            return false;
+        }
+
+        t = (e0 * z[0] + e1 * z[1] + e2 * z[2]) / det;
+        u = e1 / det;
+        v = e2 / det;
+
+        return t > 0.0f && t < t_max;
+    }
+
+    // Returns the mask of the lanes in range that are hit closer than
+    // t_max, with their ray parameters and barycentric weights.
+    static unsigned intersect_block(const Shear &s, const Block &b,
+        unsigned range, float t_max, float *t, float *u, float *v)
+    {
+#if defined(__AVX__)
+        __m256 o_x = _mm256_set1_ps(s.origin[s.kx]);
+        __m256 o_y = _mm256_set1_ps(s.origin[s.ky]);
+        __m256 o_z = _mm256_set1_ps(s.origin[s.kz]);
+        __m256 l_x = _mm256_set1_ps(s.origin_low[s.kx]);
+        __m256 l_y = _mm256_set1_ps(s.origin_low[s.ky]);
+        __m256 l_z = _mm256_set1_ps(s.origin_low[s.kz]);
+        __m256 s_x = _mm256_set1_ps(s.sx);
+        __m256 s_y = _mm256_set1_ps(s.sy);
+        __m256 s_z = _mm256_set1_ps(s.sz);
+        __m256 x[3];
+        __m256 y[3];
+        __m256 z[3];
+
+        for (int i = 0; i < 3; ++i)
+        {
+            __m256 px = _mm256_sub_ps(_mm256_sub_ps(
+                _mm256_load_ps(b.v[i][s.kx]), o_x), l_x);
+            __m256 py = _mm256_sub_ps(_mm256_sub_ps(
+                _mm256_load_ps(b.v[i][s.ky]), o_y), l_y);
+            __m256 pz = _mm256_sub_ps(_mm256_sub_ps(
+                _mm256_load_ps(b.v[i][s.kz]), o_z), l_z);
+
+            x[i] = _mm256_sub_ps(px, _mm256_mul_ps(s_x, pz));
+            y[i] = _mm256_sub_ps(py, _mm256_mul_ps(s_y, pz));
+            z[i] = _mm256_mul_ps(s_z, pz);
+        }
+
+        __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]),
+            _mm256_mul_ps(y[2], x[1]));
+        __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]),
+            _mm256_mul_ps(y[0], x[2]));
+        __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]),
+            _mm256_mul_ps(y[1], x[0]));
+
+        __m256 zero = _mm256_setzero_ps();
+        __m256 negative = _mm256_or_ps(_mm256_or_ps(
+            _mm256_cmp_ps(e0, zero, _CMP_LT_OQ),
+            _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)),
+            _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+        __m256 positive = _mm256_or_ps(_mm256_or_ps(
+            _mm256_cmp_ps(e0, zero, _CMP_GT_OQ),
+            _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)),
+            _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+        __m256 on_edge = _mm256_or_ps(_mm256_or_ps(
+            _mm256_cmp_ps(e0, zero, _CMP_EQ_OQ),
+            _mm256_cmp_ps(e1, zero, _CMP_EQ_OQ)),
+            _mm256_cmp_ps(e2, zero, _CMP_EQ_OQ));
+
+        __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+        __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+        __m256 t_hit = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(e0, z[0]), _mm256_mul_ps(e1, z[1])),
+            _mm256_mul_ps(e2, z[2])), inv_det);
+
+        __m256 hit = _mm256_andnot_ps(_mm256_and_ps(negative, positive),
+            _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ),
+            _mm256_and_ps(_mm256_cmp_ps(t_hit, zero, _CMP_GT_OQ),
+            _mm256_cmp_ps(t_hit, _mm256_set1_ps(t_max), _CMP_LT_OQ))));
+
+        _mm256_store_ps(t, t_hit);
+        _mm256_store_ps(u, _mm256_mul_ps(e1, inv_det));
+        _mm256_store_ps(v, _mm256_mul_ps(e2, inv_det));
+
+        unsigned mask = _mm256_movemask_ps(hit) & range;
+        unsigned edges = _mm256_movemask_ps(on_edge) & range;
+#elif defined(__SSE__)
+        __m128 o_x = _mm_set1_ps(s.origin[s.kx]);
+        __m128 o_y = _mm_set1_ps(s.origin[s.ky]);
+        __m128 o_z = _mm_set1_ps(s.origin[s.kz]);
+        __m128 l_x = _mm_set1_ps(s.origin_low[s.kx]);
+        __m128 l_y = _mm_set1_ps(s.origin_low[s.ky]);
+        __m128 l_z = _mm_set1_ps(s.origin_low[s.kz]);
+        __m128 s_x = _mm_set1_ps(s.sx);
+        __m128 s_y = _mm_set1_ps(s.sy);
+        __m128 s_z = _mm_set1_ps(s.sz);
+        __m128 x[3];
+        __m128 y[3];
+        __m128 z[3];
+
+        for (int i = 0; i < 3; ++i)
+        {
+            __m128 px = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(b.v[i][s.kx]),
+                o_x), l_x);
+            __m128 py = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(b.v[i][s.ky]),
+                o_y), l_y);
+            __m128 pz = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(b.v[i][s.kz]),
+                o_z), l_z);
+
+            x[i] = _mm_sub_ps(px, _mm_mul_ps(s_x, pz));
+            y[i] = _mm_sub_ps(py, _mm_mul_ps(s_y, pz));
+            z[i] = _mm_mul_ps(s_z, pz);
+        }
+
+        __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[2], y[1]),
+            _mm_mul_ps(y[2], x[1]));
+        __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[0], y[2]),
+            _mm_mul_ps(y[0], x[2]));
+        __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[1], y[0]),
+            _mm_mul_ps(y[1], x[0]));
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero),
+            _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+        __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero),
+            _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+        __m128 on_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero),
+            _mm_cmpeq_ps(e1, zero)), _mm_cmpeq_ps(e2, zero));
+
+        __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+        __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 t_hit = _mm_mul_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])),
+            _mm_mul_ps(e2, z[2])), inv_det);
+
+        __m128 hit = _mm_andnot_ps(_mm_and_ps(negative, positive),
+            _mm_and_ps(_mm_cmpneq_ps(det, zero),
+            _mm_and_ps(_mm_cmpgt_ps(t_hit, zero),
+            _mm_cmplt_ps(t_hit, _mm_set1_ps(t_max)))));
+
+        _mm_store_ps(t, t_hit);
+        _mm_store_ps(u, _mm_mul_ps(e1, inv_det));
+        _mm_store_ps(v, _mm_mul_ps(e2, inv_det));
+
+        unsigned mask = _mm_movemask_ps(hit) & range;
+        unsigned edges = _mm_movemask_ps(on_edge) & range;
+#else
+        unsigned mask = 0;
+        unsigned edges = range;
+#endif
+
+        for (; edges != 0; edges &= edges - 1)
+        {
+            int c = __builtin_ctz(edges);
+
+            if (intersect_lane(s, b, c, t_max, t[c], u[c], v[c]))
+            {
+                mask |= 1u << c;
+            }
+            else
+            {
+                mask &= ~(1u << c);
+            }
+        }
+
+        return mask;
+    }
+};
+
+#endif // TRIANGLE_BLOCKS_H
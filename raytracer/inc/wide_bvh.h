@@ -0,0 +1,807 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif
+
+#include <glm/vec3.hpp>
+
+#include "ray.h"
+#include "bvh.h"
+#include "mapped_array.h"
+
+template <size_t N>
+struct alignas(32) WideNode
+{
+    float min_x[N];
+    float min_y[N];
+    float min_z[N];
+    float max_x[N];
+    float max_y[N];
+    float max_z[N];
+
+    uint32_t offset[N];
+    uint16_t count[N];
+
+    void clear(const BoundingBox &)
+    {
+        std::fill(min_x, min_x + N, std::numeric_limits<float>::infinity());
+        std::fill(min_y, min_y + N, std::numeric_limits<float>::infinity());
+        std::fill(min_z, min_z + N, std::numeric_limits<float>::infinity());
+        std::fill(max_x, max_x + N, -std::numeric_limits<float>::infinity());
+        std::fill(max_y, max_y + N, -std::numeric_limits<float>::infinity());
+        std::fill(max_z, max_z + N, -std::numeric_limits<float>::infinity());
+        std::fill(offset, offset + N, std::numeric_limits<uint32_t>::max());
+        std::fill(count, count + N, 0);
+    }
+
+    void set_box(size_t c, const BoundingBox &box)
+    {
+        min_x[c] = box.min().x;
+        min_y[c] = box.min().y;
+        min_z[c] = box.min().z;
+        max_x[c] = box.max().x;
+        max_y[c] = box.max().y;
+        max_z[c] = box.max().z;
+    }
+
+    void bounds(const float *b[6], float (&)[6][N]) const
+    {
+        b[0] = min_x;
+        b[1] = min_y;
+        b[2] = min_z;
+        b[3] = max_x;
+        b[4] = max_y;
+        b[5] = max_z;
+    }
+
+    // Sets the first size children to the nodes or object ranges given by
+    // o and k (0 for an inner child); the others stay empty.
+    void set_links(uint32_t, const uint32_t (&o)[N], const uint32_t (&k)[N],
+        size_t size)
+    {
+        std::copy(o, o + size, offset);
+        std::copy(k, k + size, count);
+    }
+
+    // Offsets and counts of the children, UINT32_MAX marking an empty one.
+    void links(uint32_t, uint32_t (&o)[N], uint32_t (&k)[N]) const
+    {
+        std::copy(offset, offset + N, o);
+        std::copy(count, count + N, k);
+    }
+};
+
+// Child boxes stored as 8-bit coordinates on a grid that starts at the
+// minimum corner of the node and has a power of two step per axis. Used
+// children take the first slots; the inner ones are stored next to each
+// other from node_base nodes after this one, and the objects of the leaf
+// ones follow each other from object_base, so that a child only needs the
+// 8-bit count of its objects (0 for an inner child).
+template <size_t N>
+struct QuantizedWideNode
+{
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t children;
+    uint8_t q_min[3][N];
+    uint8_t q_max[3][N];
+
+    uint32_t node_base;
+    uint32_t object_base;
+    uint8_t count[N];
+
+    static constexpr size_t max_count = std::numeric_limits<uint8_t>::max();
+
+    static float scale(int8_t e)
+    {
+        uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+        float f;
+
+        std::memcpy(&f, &bits, sizeof(f));
+
+        return f;
+    }
+
+    void clear(const BoundingBox &parent)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float extent = parent.max()[a] - parent.min()[a];
+            int e = (extent > 0) ?
+                static_cast<int>(std::ceil(std::log2(extent / 255.0f))) :
+                -126;
+
+            e = std::max(e, -126);
+
+            while (parent.min()[a] + 255.0f * scale(e) < parent.max()[a])
+            {
+                ++e;
+            }
+
+            origin[a] = parent.min()[a];
+            exponent[a] = e;
+        }
+
+        children = 0;
+        std::fill(&q_min[0][0], &q_min[0][0] + 3 * N, 255);
+        std::fill(&q_max[0][0], &q_max[0][0] + 3 * N, 0);
+        node_base = 0;
+        object_base = 0;
+        std::fill(count, count + N, 0);
+    }
+
+    void set_box(size_t c, const BoundingBox &box)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            float s = scale(exponent[a]);
+            float lo = std::floor((box.min()[a] - origin[a]) / s);
+            float hi = std::ceil((box.max()[a] - origin[a]) / s);
+            int q_lo = static_cast<int>(std::clamp(lo, 0.0f, 255.0f));
+            int q_hi = static_cast<int>(std::clamp(hi, 0.0f, 255.0f));
+
+            while (q_lo > 0 && origin[a] + q_lo * s > box.min()[a])
+            {
+                --q_lo;
+            }
+
+            while (q_hi < 255 && origin[a] + q_hi * s < box.max()[a])
+            {
+                ++q_hi;
+            }
+
+            q_min[a][c] = q_lo;
+            q_max[a][c] = q_hi;
+        }
+    }
+
+    void bounds(const float *b[6], float (&decoded)[6][N]) const
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+
+        for (int a = 0; a < 3; ++a)
+        {
+            float s = scale(exponent[a]);
+
+#if defined(__SSE2__)
+            for (size_t c = 0; c < N; c += 4)
+            {
+                __m128 used = _mm_castsi128_ps(_mm_cmplt_epi32(
+                    _mm_setr_epi32(c, c + 1, c + 2, c + 3),
+                    _mm_set1_epi32(children)));
+
+                _mm_store_ps(decoded[a] + c, _mm_or_ps(_mm_and_ps(used,
+                    decode(q_min[a] + c, origin[a], s)),
+                    _mm_andnot_ps(used, _mm_set1_ps(inf))));
+                _mm_store_ps(decoded[a + 3] + c, _mm_or_ps(_mm_and_ps(used,
+                    decode(q_max[a] + c, origin[a], s)),
+                    _mm_andnot_ps(used, _mm_set1_ps(-inf))));
+            }
+#else
+            for (size_t c = 0; c < N; ++c)
+            {
+                decoded[a][c] = (c < children) ?
+                    origin[a] + q_min[a][c] * s : inf;
+                decoded[a + 3][c] = (c < children) ?
+                    origin[a] + q_max[a][c] * s : -inf;
+            }
+#endif
+
+            b[a] = decoded[a];
+            b[a + 3] = decoded[a + 3];
+        }
+    }
+
+    // Inner children must be given at consecutive offsets, and so must the
+    // object ranges of leaf children, in the order of their slots.
+    void set_links(uint32_t index, const uint32_t (&o)[N],
+        const uint32_t (&k)[N], size_t size)
+    {
+        bool inner = false;
+        bool leaf = false;
+
+        children = size;
+
+        for (size_t c = 0; c < size; ++c)
+        {
+            if (k[c] > 0 && !leaf)
+            {
+                object_base = o[c];
+                leaf = true;
+            }
+            else if (k[c] == 0 && !inner)
+            {
+                node_base = o[c] - index;
+                inner = true;
+            }
+
+            count[c] = k[c];
+        }
+    }
+
+    void links(uint32_t index, uint32_t (&o)[N], uint32_t (&k)[N]) const
+    {
+        uint32_t node = index + node_base;
+        uint32_t object = object_base;
+
+        for (size_t c = 0; c < N; ++c)
+        {
+            k[c] = (c < children) ? count[c] : 0;
+            o[c] = (c >= children) ? std::numeric_limits<uint32_t>::max() :
+                (k[c] > 0) ? object : node;
+            object += k[c];
+            node += (c < children && k[c] == 0);
+        }
+    }
+
+private:
+#if defined(__SSE2__)
+    // origin + q * s for four 8-bit coordinates, as in the scalar form.
+    static __m128 decode(const uint8_t *q, float origin, float s)
+    {
+        int32_t bytes;
+
+        std::memcpy(&bytes, q, sizeof(bytes));
+
+        __m128i zero = _mm_setzero_si128();
+        __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(
+            _mm_cvtsi32_si128(bytes), zero), zero);
+
+        return _mm_add_ps(_mm_set1_ps(origin),
+            _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(s)));
+    }
+#endif
+};
+
+template <size_t N, bool Quantized = false>
+class WideBVH
+{
+    static_assert(N == 4 || N == 8, "WideBVH supports 4 or 8 children");
+
+public:
+    using Node = typename std::conditional<Quantized,
+        QuantizedWideNode<N>, WideNode<N>>::type;
+
+    static constexpr size_t width = N;
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+    static constexpr size_t max_depth = BVH<char>::max_depth;
+
+private:
+    struct Entry
+    {
+        uint32_t offset;
+        uint32_t count;
+        float distance;
+    };
+
+    MappedArray<Node> _nodes;
+    BoundingBox _box;
+
+public:
+    WideBVH() = default;
+    WideBVH(MappedArray<Node> nodes, const BoundingBox &box) :
+        _nodes(std::move(nodes)), _box(box) {}
+
+    const MappedArray<Node> &nodes() const { return _nodes; }
+    const BoundingBox &box() const { return _box; }
+    bool empty() const { return _nodes.empty(); }
+    size_t memory() const { return _nodes.size() * sizeof(Node); }
+
+    double sah_cost() const
+    {
+        if (_nodes.empty())
+        {
+            return 0.0d;
+        }
+
+        double cost = _box.surface_area();
+
+        for (uint32_t i = 0; i < _nodes.size(); ++i)
+        {
+            alignas(32) float decoded[6][N];
+            const float *b[6];
+            uint32_t offset[N];
+            uint32_t count[N];
+
+            _nodes[i].bounds(b, decoded);
+            _nodes[i].links(i, offset, count);
+
+            for (size_t c = 0; c < N; ++c)
+            {
+                if (offset[c] != none)
+                {
+                    BoundingBox box(glm::vec3(b[0][c], b[1][c], b[2][c]),
+                        glm::vec3(b[3][c], b[4][c], b[5][c]));
+
+                    cost += box.surface_area() *
+                        ((count[c] > 0) ? count[c] : 1);
+                }
+            }
+        }
+
+        return cost / _box.surface_area();
+    }
+
+    // Collapses a binary BVH. The objects of the leaf children of every
+    // node are laid out next to each other, which quantized nodes rely on,
+    // so the objects are reordered: order receives, for each object of the
+    // wide tree, the index of the binary tree object it is.
+    template <class T>
+    static WideBVH<N, Quantized> collapse(const BVH<T> &bvh,
+        std::vector<uint32_t> &order)
+    {
+        order.clear();
+
+        if (bvh.nodes().empty())
+        {
+            return WideBVH<N, Quantized>();
+        }
+
+        std::vector<Node> nodes(1);
+
+        order.reserve(bvh.objects().size());
+        collapse_node(nodes, bvh.nodes(), 0, 0, order);
+
+        return WideBVH<N, Quantized>(std::move(nodes), bvh.nodes()[0].box);
+    }
+
+    // Recomputes the child boxes bottom-up, keeping the shape of the tree,
+    // for objects that have moved; box(offset, count) bounds the objects of
+    // a leaf. Quantized nodes are encoded again against their new boxes.
+    template <typename TBoxFn>
+    void refit(const TBoxFn &box)
+    {
+        if (!_nodes.empty())
+        {
+            _box = refit_node(box, 0);
+        }
+    }
+
+    // Calls fn(offset, count) for the objects of every leaf.
+    template <typename TFn>
+    void for_each_leaf(const TFn &fn) const
+    {
+        for (uint32_t i = 0; i < _nodes.size(); ++i)
+        {
+            uint32_t offset[N];
+            uint32_t count[N];
+
+            _nodes[i].links(i, offset, count);
+
+            for (size_t c = 0; c < N; ++c)
+            {
+                if (offset[c] != none && count[c] > 0)
+                {
+                    fn(offset[c], count[c]);
+                }
+            }
+        }
+    }
+
+    template <typename T, typename TFn>
+    void intersect(const Ray &r, double t_max, const std::vector<T> &objects,
+        const TFn &fn) const
+    {
+        intersect_leaves(r, t_max,
+            [&](uint32_t offset, uint32_t count, double &t)
+            {
+                for (uint32_t k = offset; k < offset + count; ++k)
+                {
+                    fn(objects[k], t);
+                }
+            });
+    }
+
+    template <typename T, typename TFn>
+    bool occluded(const Ray &r, double t_max, const std::vector<T> &objects,
+        const TFn &fn) const
+    {
+        return occluded_leaves(r, t_max,
+            [&](uint32_t offset, uint32_t count)
+            {
+                for (uint32_t k = offset; k < offset + count; ++k)
+                {
+                    if (fn(objects[k]))
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            });
+    }
+
+    // Leaf visitors in the manner of BVH::intersect_leaves and
+    // BVH::occluded_leaves.
+    template <typename TFn>
+    void intersect_leaves(const Ray &r, double t_max, const TFn &fn) const
+    {
+        if (_nodes.empty() || r.degenerate() || !_box.intersects(r, t_max))
+        {
+            return;
+        }
+
+        std::array<Entry, max_depth * (N - 1) + 1> stack;
+        size_t size = 0;
+        Entry e = Entry { 0, 0, 0.0f };
+        uint64_t visited = 0;
+
+        while (true)
+        {
+            ++visited;
+
+            if (e.count > 0)
+            {
+                fn(e.offset, e.count, t_max);
+            }
+            else
+            {
+                const Node &n = _nodes[e.offset];
+                alignas(32) float distance[N];
+                uint32_t offset[N];
+                uint32_t counts[N];
+                std::array<Entry, N> hits;
+                size_t count = 0;
+
+                intersect_boxes(n, r, t_max, distance);
+                n.links(e.offset, offset, counts);
+
+                for (size_t c = 0; c < N; ++c)
+                {
+                    if (distance[c] < std::numeric_limits<float>::infinity())
+                    {
+                        size_t k = count++;
+
+                        while (k > 0 && hits[k - 1].distance < distance[c])
+                        {
+                            hits[k] = hits[k - 1];
+                            --k;
+                        }
+
+                        hits[k] = Entry { offset[c], counts[c],
+                            distance[c] };
+                    }
+                }
+
+                if (count > 0)
+                {
+                    std::copy(hits.begin(), hits.begin() + count - 1,
+                        stack.begin() + size);
+                    size += count - 1;
+                    e = hits[count - 1];
+
+                    continue;
+                }
+            }
+
+            while (size > 0 && stack[size - 1].distance > t_max)
+            {
+                --size;
+            }
+
+            if (size == 0)
+            {
+                break;
+            }
+
+            e = stack[--size];
+        }
+
+        BVHStatistics::record(visited);
+    }
+
+    template <typename TFn>
+    bool occluded_leaves(const Ray &r, double t_max, const TFn &fn) const
+    {
+        if (_nodes.empty() || r.degenerate() || !_box.intersects(r, t_max))
+        {
+            return false;
+        }
+
+        std::array<Entry, max_depth * (N - 1) + 1> stack;
+        size_t size = 0;
+        Entry e = Entry { 0, 0, 0.0f };
+        uint64_t visited = 0;
+
+        while (true)
+        {
+            ++visited;
+
+            if (e.count > 0)
+            {
+                if (fn(e.offset, e.count))
+                {
+                    BVHStatistics::record(visited);
+
+                    return true;
+                }
+            }
+            else
+            {
+                const Node &n = _nodes[e.offset];
+                alignas(32) float distance[N];
+                uint32_t offset[N];
+                uint32_t count[N];
+
+                intersect_boxes(n, r, t_max, distance);
+                n.links(e.offset, offset, count);
+
+                for (size_t c = 0; c < N; ++c)
+                {
+                    if (distance[c] < std::numeric_limits<float>::infinity())
+                    {
+                        stack[size++] = Entry { offset[c], count[c],
+                            distance[c] };
+                    }
+                }
+            }
+
+            if (size == 0)
+            {
+                BVHStatistics::record(visited);
+
+                return false;
+            }
+
+            e = stack[--size];
+        }
+    }
+
+private:
+    // Fills the wide node index, already allocated, from the binary subtree
+    // at i: its leaf children take the next objects in order, then its
+    // inner children are allocated next to each other and filled in turn.
+    template <class TNode>
+    static void collapse_node(std::vector<Node> &wide,
+        const std::vector<TNode> &nodes, uint32_t i, uint32_t index,
+        std::vector<uint32_t> &order)
+    {
+        std::array<uint32_t, N> children = { i };
+        size_t size = 1;
+
+        if (!nodes[i].leaf())
+        {
+            children = { i + 1, nodes[i].offset };
+            size = 2;
+        }
+
+        while (size < N)
+        {
+            int best = -1;
+            float best_area = -1.0f;
+
+            for (size_t c = 0; c < size; ++c)
+            {
+                const TNode &child = nodes[children[c]];
+
+                if (!child.leaf() && child.box.surface_area() > best_area)
+                {
+                    best = c;
+                    best_area = child.box.surface_area();
+                }
+            }
+
+            if (best < 0)
+            {
+                break;
+            }
+
+            uint32_t split = children[best];
+
+            children[best] = split + 1;
+            children[size++] = nodes[split].offset;
+        }
+
+        uint32_t offset[N];
+        uint32_t count[N];
+
+        for (size_t c = 0; c < size; ++c)
+        {
+            const TNode &child = nodes[children[c]];
+
+            count[c] = child.leaf() ? child.count : 0;
+
+            if (child.leaf())
+            {
+                offset[c] = order.size();
+
+                for (uint32_t k = 0; k < child.count; ++k)
+                {
+                    order.push_back(child.offset + k);
+                }
+            }
+        }
+
+        for (size_t c = 0; c < size; ++c)
+        {
+            if (count[c] == 0)
+            {
+                offset[c] = wide.size();
+                wide.push_back(Node());
+            }
+        }
+
+        Node &n = wide[index];
+
+        n.clear(nodes[i].box);
+        n.set_links(index, offset, count, size);
+
+        for (size_t c = 0; c < size; ++c)
+        {
+            n.set_box(c, nodes[children[c]].box);
+        }
+
+        for (size_t c = 0; c < size; ++c)
+        {
+            if (count[c] == 0)
+            {
+                collapse_node(wide, nodes, children[c], offset[c], order);
+            }
+        }
+    }
+
+    template <typename TBoxFn>
+    BoundingBox refit_node(const TBoxFn &box_fn, uint32_t index)
+    {
+        std::array<BoundingBox, N> boxes;
+        BoundingBox box = BoundingBox::empty();
+        uint32_t offset[N];
+        uint32_t count[N];
+        size_t size = 0;
+
+        _nodes[index].links(index, offset, count);
+
+        while (size < N && offset[size] != none)
+        {
+            boxes[size] = (count[size] > 0) ?
+                box_fn(offset[size], count[size]) :
+                refit_node(box_fn, offset[size]);
+            box = BoundingBox::combine(box, boxes[size]);
+            ++size;
+        }
+
+        // Clearing resets the links as well, so they are put back.
+        Node &n = _nodes[index];
+
+        n.clear(box);
+        n.set_links(index, offset, count, size);
+
+        for (size_t c = 0; c < size; ++c)
+        {
+            n.set_box(c, boxes[c]);
+        }
+
+        return box;
+    }
+
+    void intersect_boxes(const Node &n, const Ray &r, double t_max,
+        float *distance) const
+    {
+        const float robust = 1.0f + 2.0f * 3.0f *
+            std::numeric_limits<float>::epsilon();
+        const glm::vec3 &o = r.box_origin();
+        const glm::vec3 &inv = r.inv_direction();
+        const glm::uvec3 &sign = r.sign();
+
+        alignas(32) float decoded[6][N];
+        const float *b[6];
+
+        n.bounds(b, decoded);
+
+        const float *near_x = b[3 * sign.x];
+        const float *far_x = b[3 - 3 * sign.x];
+        const float *near_y = b[1 + 3 * sign.y];
+        const float *far_y = b[4 - 3 * sign.y];
+        const float *near_z = b[2 + 3 * sign.z];
+        const float *far_z = b[5 - 3 * sign.z];
+
+#if defined(__AVX__)
+        if constexpr (N == 8)
+        {
+            __m256 o_x = _mm256_set1_ps(o.x);
+            __m256 o_y = _mm256_set1_ps(o.y);
+            __m256 o_z = _mm256_set1_ps(o.z);
+            __m256 inv_x = _mm256_set1_ps(inv.x);
+            __m256 inv_y = _mm256_set1_ps(inv.y);
+            __m256 inv_z = _mm256_set1_ps(inv.z);
+
+            __m256 t_enter = _mm256_setzero_ps();
+            __m256 t_exit = _mm256_set1_ps(static_cast<float>(t_max));
+
+            t_enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(
+                _mm256_load_ps(near_x), o_x), inv_x), t_enter);
+            t_enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(
+                _mm256_load_ps(near_y), o_y), inv_y), t_enter);
+            t_enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(
+                _mm256_load_ps(near_z), o_z), inv_z), t_enter);
+            t_exit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(
+                _mm256_load_ps(far_x), o_x), inv_x), t_exit);
+            t_exit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(
+                _mm256_load_ps(far_y), o_y), inv_y), t_exit);
+            t_exit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(
+                _mm256_load_ps(far_z), o_z), inv_z), t_exit);
+
+            __m256 hit = _mm256_cmp_ps(t_enter, _mm256_mul_ps(t_exit,
+                _mm256_set1_ps(robust)), _CMP_LE_OQ);
+
+            _mm256_store_ps(distance, _mm256_blendv_ps(
+                _mm256_set1_ps(std::numeric_limits<float>::infinity()),
+                t_enter, hit));
+
+            return;
+        }
+#endif
+
+#if defined(__SSE__)
+        if constexpr (N == 4)
+        {
+            __m128 o_x = _mm_set1_ps(o.x);
+            __m128 o_y = _mm_set1_ps(o.y);
+            __m128 o_z = _mm_set1_ps(o.z);
+            __m128 inv_x = _mm_set1_ps(inv.x);
+            __m128 inv_y = _mm_set1_ps(inv.y);
+            __m128 inv_z = _mm_set1_ps(inv.z);
+
+            __m128 t_enter = _mm_setzero_ps();
+            __m128 t_exit = _mm_set1_ps(static_cast<float>(t_max));
+
+            t_enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(
+                _mm_load_ps(near_x), o_x), inv_x), t_enter);
+            t_enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(
+                _mm_load_ps(near_y), o_y), inv_y), t_enter);
+            t_enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(
+                _mm_load_ps(near_z), o_z), inv_z), t_enter);
+            t_exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(
+                _mm_load_ps(far_x), o_x), inv_x), t_exit);
+            t_exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(
+                _mm_load_ps(far_y), o_y), inv_y), t_exit);
+            t_exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(
+                _mm_load_ps(far_z), o_z), inv_z), t_exit);
+
+            __m128 hit = _mm_cmple_ps(t_enter,
+                _mm_mul_ps(t_exit, _mm_set1_ps(robust)));
+
+            _mm_store_ps(distance, _mm_or_ps(_mm_and_ps(hit, t_enter),
+                _mm_andnot_ps(hit, _mm_set1_ps(
+                std::numeric_limits<float>::infinity()))));
+
+            return;
+        }
+#endif
+
+        for (size_t c = 0; c < N; ++c)
+        {
+            float t_near_x = (near_x[c] - o.x) * inv.x;
+            float t_near_y = (near_y[c] - o.y) * inv.y;
+            float t_near_z = (near_z[c] - o.z) * inv.z;
+            float t_far_x = (far_x[c] - o.x) * inv.x;
+            float t_far_y = (far_y[c] - o.y) * inv.y;
+            float t_far_z = (far_z[c] - o.z) * inv.z;
+
+            float t_enter = 0.0f;
+            float t_exit = static_cast<float>(t_max);
+
+            t_enter = (t_near_x > t_enter) ? t_near_x : t_enter;
+            t_enter = (t_near_y > t_enter) ? t_near_y : t_enter;
+            t_enter = (t_near_z > t_enter) ? t_near_z : t_enter;
+            t_exit = (t_far_x < t_exit) ? t_far_x : t_exit;
+            t_exit = (t_far_y < t_exit) ? t_far_y : t_exit;
+            t_exit = (t_far_z < t_exit) ? t_far_z : t_exit;
+
+            distance[c] = (t_enter <= t_exit * robust) ?
+                t_enter : std::numeric_limits<float>::infinity();
+        }
+    }
+};
+
+#endif // WIDE_BVH_H
@@ -1,5 +1,8 @@
+#include <cstdint>
 #include <fstream>
+#include <iterator>
 #include <memory>
+#include <vector>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb/stb_image_write.h>
@@ -25,3 +28,62 @@ int Image::save_bmp(const std::string &fname) const
     return stbi_write_bmp(fname.c_str(), _size.x, _size.y, 3,
         reinterpret_cast<const void *>(raw.get()));
 }
+
+bool Image::load_bmp(const std::string &fname)
+{
+    std::ifstream in(fname, std::ifstream::binary);
+    std::vector<unsigned char> file((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+
+    auto read =
+        [&](size_t offset, size_t size)
+        {
+            uint32_t value = 0;
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                value |= static_cast<uint32_t>(file[offset + i]) << (8 * i);
+            }
+
+            return value;
+        };
+
+    if (file.size() < 54 || file[0] != 'B' || file[1] != 'M' ||
+        read(28, 2) != 24 || read(30, 4) != 0)
+    {
+        return false;
+    }
+
+    size_t offset = read(10, 4);
+    int32_t width = static_cast<int32_t>(read(18, 4));
+    int32_t height = static_cast<int32_t>(read(22, 4));
+    bool bottom_up = height > 0;
+
+    height = std::abs(height);
+
+    // Rows are padded to a multiple of 4 bytes.
+    size_t stride = (3 * static_cast<size_t>(width) + 3) & ~size_t(3);
+
+    if (width <= 0 || height == 0 ||
+        file.size() < offset + stride * height)
+    {
+        return false;
+    }
+
+    _size = glm::uvec2(width, height);
+    _data = std::make_unique<Pixel[]>(_size.x * _size.y);
+
+    for (size_t y = 0; y < _size.y; ++y)
+    {
+        const unsigned char *row = &file[offset +
+            stride * (bottom_up ? _size.y - 1 - y : y)];
+
+        for (size_t x = 0; x < _size.x; ++x)
+        {
+            _data[x + y * _size.x] =
+                Pixel { row[3 * x + 2], row[3 * x + 1], row[3 * x] };
+        }
+    }
+
+    return true;
+}
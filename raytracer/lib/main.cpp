@@ -3,6 +3,11 @@
 #include <string>
 #include <unordered_map>
 #include <memory>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <chrono>
+#include <vector>
 
 #include <omp.h>
 
@@ -15,6 +20,155 @@
 #include "scene_loader.h"
 #include "timer.h"
 
+// Rays from random points around the camera of scene 2 in random
+// directions against six spheres of radius 1e5, the walls that scene 2 was
+// built from before it had boxes. Reports how far the hit points of the
+// textbook quadratic and of Sphere::distance land from the surface, both
+// measured against a long double solution, and how many tests per second
+// each runs.
+static void benchmark_spheres(size_t rays)
+{
+    const glm::dvec3 camera(0, 0, 0);
+    const std::vector<Sphere> spheres
+    {
+        Sphere(svec3(1e5 + 20, 0, -20), 1e5, nullptr),
+        Sphere(svec3(-1e5 - 20, 0, -20), 1e5, nullptr),
+        Sphere(svec3(0, 0, 1e5 + 0.5), 1e5, nullptr),
+        Sphere(svec3(0, 0, -1e5 - 40), 1e5, nullptr),
+        Sphere(svec3(0, -1e5 - 10, -20), 1e5, nullptr),
+        Sphere(svec3(0, 1e5 + 14, -20), 1e5, nullptr)
+    };
+
+    std::mt19937_64 generator(1);
+    std::uniform_real_distribution<double> uniform(-1.0d, 1.0d);
+    std::vector<glm::dvec3> origins(rays);
+    std::vector<glm::dvec3> directions(rays);
+
+    for (size_t i = 0; i < rays; ++i)
+    {
+        glm::dvec3 d;
+
+        do
+        {
+            d = glm::dvec3(uniform(generator), uniform(generator),
+                uniform(generator));
+        }
+        while (glm::dot(d, d) > 1.0d || glm::dot(d, d) < 1e-6d);
+
+        origins[i] = camera + 10.0d * glm::dvec3(uniform(generator),
+            uniform(generator), uniform(generator));
+        directions[i] = glm::normalize(d);
+    }
+
+    auto textbook =
+        [](const Sphere::Packed<double> &s, const glm::dvec3 &o,
+            const glm::dvec3 &d)
+        {
+            glm::dvec3 l = o - glm::dvec3(s.center.x, s.center.y, s.center.z);
+            double a = glm::dot(d, d);
+            double b = 2.0d * glm::dot(d, l);
+            double c = glm::dot(l, l) - s.radius * s.radius;
+            double e = b * b - 4 * c * a;
+
+            if (e < 0)
+            {
+                return std::numeric_limits<double>::infinity();
+            }
+
+            double t_0 = -(b + std::sqrt(e)) / (2 * a);
+            double t_1 = -(b - std::sqrt(e)) / (2 * a);
+
+            return (std::min(t_0, t_1) >= 0) ? std::min(t_0, t_1) :
+                (std::max(t_0, t_1) >= 0) ? std::max(t_0, t_1) :
+                std::numeric_limits<double>::infinity();
+        };
+
+    auto kernel =
+        [](const Sphere::Packed<double> &s, const glm::dvec3 &o,
+            const glm::dvec3 &d)
+        {
+            return Sphere::distance<double>(s, simd::splat<double>(o),
+                simd::splat<double>(d),
+                std::numeric_limits<double>::infinity());
+        };
+
+    // Distance of the hit point from the surface, in long double; hits
+    // that the reference misses, or misses it hits, are counted apart.
+    auto measure =
+        [&](const char *name, const auto &distance)
+        {
+            long double max_error = 0.0l;
+            long double total_error = 0.0l;
+            size_t hits = 0;
+            size_t mismatches = 0;
+            double sum = 0.0d;
+
+            for (const Sphere &sphere : spheres)
+            {
+                Sphere::Packed<double> s = sphere.packed();
+
+                for (size_t i = 0; i < rays; ++i)
+                {
+                    double t = distance(s, origins[i], directions[i]);
+                    bool reference = std::isfinite(kernel(s, origins[i],
+                        directions[i]));
+
+                    if (std::isfinite(t) != reference)
+                    {
+                        ++mismatches;
+                    }
+
+                    if (!std::isfinite(t))
+                    {
+                        continue;
+                    }
+
+                    long double x = origins[i].x + t * (long double)
+                        directions[i].x - s.center.x;
+                    long double y = origins[i].y + t * (long double)
+                        directions[i].y - s.center.y;
+                    long double z = origins[i].z + t * (long double)
+                        directions[i].z - s.center.z;
+                    long double error = std::abs(std::sqrt(x * x + y * y +
+                        z * z) - (long double) s.radius);
+
+                    max_error = std::max(max_error, error);
+                    total_error += error;
+                    ++hits;
+                }
+            }
+
+            auto start = std::chrono::high_resolution_clock::now();
+
+            for (const Sphere &sphere : spheres)
+            {
+                Sphere::Packed<double> s = sphere.packed();
+
+                for (size_t i = 0; i < rays; ++i)
+                {
+                    double t = distance(s, origins[i], directions[i]);
+
+                    sum += std::isfinite(t) ? t : 0.0d;
+                }
+            }
+
+            double seconds = std::chrono::duration<double>(
+                std::chrono::high_resolution_clock::now() - start).count();
+
+            std::cout << name << ": surface error max " <<
+                (double) max_error << ", mean " <<
+                (double) (total_error / std::max<size_t>(hits, 1)) <<
+                ", hit/miss mismatches " << mismatches << ", " <<
+                spheres.size() * rays / seconds * 1e-6 <<
+                " million tests/s (checksum " << sum << ")." << std::endl;
+        };
+
+    std::cout << "Sphere precision, " << rays << " rays against " <<
+        spheres.size() << " spheres:" << std::endl;
+    measure("Textbook quadratic", textbook);
+    measure("Sphere::distance", kernel);
+}
+
 int main(int argc, char *argv[])
 {
     std::unordered_map<std::string, std::string> arg_list;
@@ -46,6 +200,31 @@ int main(int argc, char *argv[])
         arg_list["-out"] : std::string("out_") +
         std::to_string(options.scene_num) + std::string(".bmp");
 
+    std::unordered_map<std::string, BVHOptions::Builder> bvh_builders =
+    {
+        { "morton", BVHOptions::MORTON },
+        { "sah", BVHOptions::SAH },
+        { "lbvh", BVHOptions::LBVH },
+        { "sbvh", BVHOptions::SBVH }
+    };
+
+    options.bvh.builder = (arg_list.find("-bvh") != arg_list.end() &&
+        bvh_builders.find(arg_list["-bvh"]) != bvh_builders.end()) ?
+        bvh_builders[arg_list["-bvh"]] : BVHOptions::SAH;
+    options.bvh.width = (arg_list.find("-bvh_width") != arg_list.end()) ?
+        std::atoi(arg_list["-bvh_width"].c_str()) : 4;
+    options.bvh.quantized =
+        (arg_list.find("-bvh_quantized") != arg_list.end()) ?
+        std::atoi(arg_list["-bvh_quantized"].c_str()) != 0 : false;
+    options.bvh.treelet_passes =
+        (arg_list.find("-bvh_treelet_passes") != arg_list.end()) ?
+        std::atoi(arg_list["-bvh_treelet_passes"].c_str()) : 0;
+    options.bvh.cache = (arg_list.find("-bvh_cache") != arg_list.end()) ?
+        std::atoi(arg_list["-bvh_cache"].c_str()) != 0 : false;
+    options.bvh.sbvh_duplication =
+        (arg_list.find("-sbvh_duplication") != arg_list.end()) ?
+        std::atof(arg_list["-sbvh_duplication"].c_str()) : 0.5f;
+
     options.size = glm::uvec2(512, 512);
     options.fov = std::acos(-1.0d) / 2.0d;
     options.max_recursion = 5;
@@ -57,7 +236,7 @@ int main(int argc, char *argv[])
 #endif
 
     Renderer renderer;
-    SceneLoader loader;
+    SceneLoader loader(options.bvh);
     std::unique_ptr<Scene> scene;
     Image img;
 
@@ -77,6 +256,16 @@ int main(int argc, char *argv[])
             options.supersampling_rays = 1;
             break;
 
+        case 4:
+            options.camera_origin = glm::dvec3(0, 3, 4);
+            options.supersampling_rays = 1;
+            break;
+
+        case 5:
+            options.camera_origin = glm::dvec3(0, 3, 2);
+            options.supersampling_rays = 1;
+            break;
+
         default:
             std::cout << "Scene " << std::to_string(options.scene_num) <<
                 " does not exist. Exiting..." << std::endl;
@@ -103,6 +292,58 @@ int main(int argc, char *argv[])
         exit(0);
     }
 
+    std::cout << "Primitive pools: " << scene->spheres().size() <<
+        " spheres, " << scene->cylinders().size() << " cylinders, " <<
+        scene->planes().size() << " planes, " << scene->quads().size() <<
+        " quads, " << scene->disks().size() << " disks, " <<
+        scene->boxes().size() << " boxes." << std::endl;
+    std::cout << "Scene BVH: " << scene->bvh().objects().size() <<
+        " bounded, " << scene->unbounded().size() << " unbounded " <<
+        "objects." << std::endl;
+
+    std::vector<const Mesh *> meshes;
+
+    for (const auto &o : scene->objects())
+    {
+        const auto *mesh = dynamic_cast<const Mesh *>(o.get());
+
+        if (const auto *instance = dynamic_cast<const Instance *>(o.get()))
+        {
+            mesh = instance->mesh().get();
+        }
+
+        if (mesh && std::find(meshes.begin(), meshes.end(), mesh) ==
+            meshes.end())
+        {
+            meshes.push_back(mesh);
+        }
+    }
+
+    for (const auto *mesh : meshes)
+    {
+        std::cout << "Mesh BVH (" <<
+            ((options.bvh.builder == BVHOptions::SAH) ? "SAH" :
+            (options.bvh.builder == BVHOptions::LBVH) ? "LBVH" :
+            (options.bvh.builder == BVHOptions::SBVH) ? "SBVH" :
+            "Morton") << ", width " << options.bvh.width <<
+            ((options.bvh.quantized) ? ", quantized" : "") <<
+            ((options.bvh.treelet_passes > 0) ? ", treelet passes " +
+            std::to_string(options.bvh.treelet_passes) : "") <<
+            "), SAH cost: " << mesh->bvh_sah_cost() <<
+            ", memory: " << mesh->bvh_memory() / 1024 << " KiB, " <<
+            "references: " << mesh->triangles().size() << "." <<
+            std::endl;
+    }
+
+    std::cout << std::endl;
+
+    if (arg_list.find("-sphere_precision") != arg_list.end())
+    {
+        benchmark_spheres(std::atoi(arg_list["-sphere_precision"].c_str()));
+
+        return 0;
+    }
+
     {
         std::cout << "Rendering..." << std::endl;
 
@@ -113,6 +354,14 @@ int main(int argc, char *argv[])
     }
 
     std::cout << "." << std::endl;
+
+    if (BVHStatistics::enabled)
+    {
+        std::cout << "BVH traversals: " << BVHStatistics::traversals() <<
+            ", nodes visited per traversal: " <<
+            BVHStatistics::nodes_per_traversal() << "." << std::endl;
+    }
+
     std::cout << std::endl;
 
     {
@@ -126,5 +375,61 @@ int main(int argc, char *argv[])
 
     std::cout << "." << std::endl;
 
+    // Compares the image with a reference rendering, for instance one of
+    // the double precision build, and fails when they differ too much.
+    if (arg_list.find("-compare") != arg_list.end())
+    {
+        double min_psnr = (arg_list.find("-compare_psnr") != arg_list.end()) ?
+            std::atof(arg_list["-compare_psnr"].c_str()) : 40.0d;
+        Image reference;
+
+        std::cout << std::endl;
+        std::cout << "Comparing with \"" << arg_list["-compare"] << "\"..." <<
+            std::endl;
+
+        if (!reference.load_bmp(arg_list["-compare"]) ||
+            reference.size() != img.size())
+        {
+            std::cout << "Failed to load a reference of the same size." <<
+                std::endl;
+
+            return 1;
+        }
+
+        size_t differing = 0;
+        double max_difference = 0.0d;
+        double squared_error = 0.0d;
+
+        for (unsigned y = 0; y < img.size().y; ++y)
+        {
+            for (unsigned x = 0; x < img.size().x; ++x)
+            {
+                glm::dvec3 d = glm::abs(img.get_pixel(glm::uvec2(x, y)) -
+                    reference.get_pixel(glm::uvec2(x, y))) * 255.0d;
+
+                differing += (d != glm::dvec3(0)) ? 1 : 0;
+                max_difference = std::max(max_difference,
+                    std::max(d.x, std::max(d.y, d.z)));
+                squared_error += glm::dot(d, d);
+            }
+        }
+
+        double mse = squared_error / (3.0d * img.size().x * img.size().y);
+        double psnr = (mse > 0.0d) ?
+            10.0d * std::log10(255.0d * 255.0d / mse) :
+            std::numeric_limits<double>::infinity();
+
+        std::cout << "Differing pixels: " << differing <<
+            ", max difference: " << max_difference << ", PSNR: " <<
+            psnr << " dB." << std::endl;
+
+        if (psnr < min_psnr)
+        {
+            std::cout << "PSNR is below " << min_psnr << " dB." << std::endl;
+
+            return 1;
+        }
+    }
+
     return 0;
 }
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mesh_cache.h"
+
+static_assert(std::is_trivially_copyable<BVH<Triangle>::Node>::value &&
+    std::is_trivially_copyable<WideBVH<4>::Node>::value &&
+    std::is_trivially_copyable<WideBVH<4, true>::Node>::value &&
+    std::is_trivially_copyable<TriangleBlocks::Block>::value &&
+    std::is_trivially_copyable<Vertex>::value &&
+    std::is_trivially_copyable<Triangle>::value,
+    "cached mesh data must be trivially copyable");
+
+static const char magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+
+// Sections start at multiples of this, so that the mapped nodes and
+// blocks are as aligned as their types ask.
+static constexpr size_t alignment = 64;
+
+static uint64_t fnv1a(const void *data, size_t size,
+    uint64_t hash = 0xcbf29ce484222325ull)
+{
+    const auto *bytes = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static size_t aligned(size_t size)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+std::optional<uint64_t> MeshCache::key(const std::string &path,
+    const BVHOptions &options)
+{
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return std::nullopt;
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add = [&](const auto &value) {
+        hash = fnv1a(&value, sizeof(value), hash); };
+
+    // A changed model almost always changes its size or modification
+    // time, and neither needs the file to be read.
+    add(static_cast<uint64_t>(st.st_size));
+    add(static_cast<int64_t>(st.st_mtim.tv_sec));
+    add(static_cast<int64_t>(st.st_mtim.tv_nsec));
+
+    add(static_cast<uint32_t>(options.builder));
+    add(static_cast<uint64_t>(options.delta));
+    add(options.epsilon);
+    add(static_cast<uint64_t>(options.sah_bins));
+    add(static_cast<uint64_t>(options.max_leaf_size));
+    add(static_cast<uint64_t>(options.treelet_size));
+    add(static_cast<uint64_t>(options.treelet_passes));
+    add(options.sbvh_duplication);
+    add(options.sbvh_alpha);
+    add(static_cast<uint64_t>(options.width));
+    add(static_cast<uint32_t>(options.quantized));
+    add(static_cast<uint32_t>(BVH_MORTON_BITS));
+    // Vertices and triangle blocks are stored as they are in memory, in
+    // the precision and the SIMD width of the build.
+    add(static_cast<uint32_t>(sizeof(Vertex)));
+    add(static_cast<uint32_t>(TriangleBlocks::width));
+
+    return hash;
+}
+
+bool MeshCache::save(const std::string &path, uint64_t key, const Mesh &mesh)
+{
+    Header header = {};
+    const void *wide_nodes = nullptr;
+
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.node_size = sizeof(BVH<Triangle>::Node);
+    header.block_size = sizeof(TriangleBlocks::Block);
+    header.key = key;
+    header.built_sah_cost = mesh._built_sah_cost;
+    header.nodes = mesh._bvh.nodes().size();
+    header.blocks = mesh._triangle_blocks.blocks().size();
+    header.vertices = mesh._vertices.size();
+    header.triangles = mesh._bvh.objects().size();
+
+    mesh.with_wide_bvh([&](const auto &wide)
+        {
+            using Node = typename std::decay_t<decltype(wide)>::Node;
+
+            header.wide_node_size = sizeof(Node);
+            header.wide_nodes = wide.nodes().size();
+            wide_nodes = wide.nodes().data();
+
+            for (int a = 0; a < 3; ++a)
+            {
+                header.box[a] = wide.box().min()[a];
+                header.box[a + 3] = wide.box().max()[a];
+            }
+        });
+
+    // Written next to the target and renamed, so that a reader never sees
+    // a partially written cache.
+    std::string temp = path + ".tmp";
+
+    {
+        std::ofstream out(temp, std::ofstream::binary);
+        auto write =
+            [&](const void *data, size_t size)
+            {
+                static const char padding[alignment] = {};
+
+                out.write(static_cast<const char *>(data), size);
+                out.write(padding, aligned(size) - size);
+            };
+
+        write(&header, sizeof(header));
+        write(mesh._bvh.nodes().data(),
+            header.nodes * sizeof(BVH<Triangle>::Node));
+        write(wide_nodes, header.wide_nodes * header.wide_node_size);
+        write(mesh._triangle_blocks.blocks().data(),
+            header.blocks * sizeof(TriangleBlocks::Block));
+        write(mesh._triangle_blocks.first().data(),
+            header.triangles * sizeof(uint32_t));
+        write(mesh._vertices.data(), header.vertices * sizeof(Vertex));
+        write(mesh._bvh.objects().data(),
+            header.triangles * sizeof(Triangle));
+
+        if (!out)
+        {
+            std::remove(temp.c_str());
+
+            return false;
+        }
+    }
+
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// Checks a tree read from a file whose key matched but that may have been
+// damaged: children must come after their parents and inside the array,
+// leaves must hold triangles that exist, and no path may be deeper than
+// the traversal stacks, which hold BVH::max_depth levels.
+template <class TNode, typename TFn>
+static bool valid_tree(const TNode *nodes, size_t size,
+    const TFn &for_each_child)
+{
+    std::vector<size_t> heights(size, 1);
+
+    for (size_t i = size; i-- > 0;)
+    {
+        bool valid = for_each_child(nodes[i], i,
+            [&](uint32_t child)
+            {
+                if (child <= i || child >= size)
+                {
+                    return false;
+                }
+
+                heights[i] = std::max(heights[i], heights[child] + 1);
+
+                return true;
+            });
+
+        if (!valid)
+        {
+            return false;
+        }
+    }
+
+    return size == 0 || heights[0] <= BVH<Triangle>::max_depth;
+}
+
+std::unique_ptr<Mesh> MeshCache::load(const std::string &path, uint64_t key,
+    const Material *material, const BVHOptions &options)
+{
+    using Node = BVH<Triangle>::Node;
+    using Block = TriangleBlocks::Block;
+
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header))
+    {
+        close(fd);
+
+        return nullptr;
+    }
+
+    // Private and writable, so that refitting the mesh later writes to
+    // copies of the pages it touches rather than to the file.
+    size_t size = st.st_size;
+    void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fd, 0);
+
+    close(fd);
+
+    if (address == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<void> mapping(address,
+        [size](void *p) { munmap(p, size); });
+    char *data = static_cast<char *>(address);
+    Header header;
+
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+        header.version != version || header.node_size != sizeof(Node) ||
+        header.block_size != sizeof(Block) ||
+        header.wide_node_size > sizeof(WideBVH<8>::Node) || header.key != key ||
+        header.nodes > size || header.wide_nodes > size ||
+        header.blocks > size || header.vertices > size ||
+        header.triangles > size)
+    {
+        return nullptr;
+    }
+
+    size_t at = aligned(sizeof(Header));
+    auto section =
+        [&](size_t bytes)
+        {
+            char *start = data + std::min(at, size);
+
+            at += aligned(bytes);
+
+            return start;
+        };
+
+    auto *nodes = reinterpret_cast<Node *>(section(header.nodes *
+        sizeof(Node)));
+    char *wide_nodes = section(header.wide_nodes * header.wide_node_size);
+    auto *blocks = reinterpret_cast<Block *>(section(header.blocks *
+        sizeof(Block)));
+    auto *first = reinterpret_cast<uint32_t *>(section(header.triangles *
+        sizeof(uint32_t)));
+    const auto *vertices = reinterpret_cast<const Vertex *>(section(
+        header.vertices * sizeof(Vertex)));
+    const auto *triangles = reinterpret_cast<const Triangle *>(section(
+        header.triangles * sizeof(Triangle)));
+
+    // A mesh is traced with either its binary tree or a wide one.
+    if (at != size || (header.triangles > 0 &&
+        (header.nodes == 0) == (header.wide_nodes == 0)))
+    {
+        return nullptr;
+    }
+
+    // Reject files that would index out of range, in case a cache with a
+    // matching key was damaged.
+    for (size_t i = 0; i < header.triangles; ++i)
+    {
+        if (triangles[i].a >= header.vertices ||
+            triangles[i].b >= header.vertices ||
+            triangles[i].c >= header.vertices)
+        {
+            return nullptr;
+        }
+    }
+
+    for (size_t i = 0; i < header.blocks; ++i)
+    {
+        for (size_t c = 0; c < TriangleBlocks::width; ++c)
+        {
+            if (blocks[i].index[c] >= header.triangles)
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    auto leaf =
+        [&](uint64_t offset, uint64_t count)
+        {
+            return offset < header.triangles &&
+                offset + count <= header.triangles &&
+                first[offset] + (count + TriangleBlocks::width - 1) /
+                TriangleBlocks::width <= header.blocks;
+        };
+
+    if (!valid_tree(nodes, header.nodes,
+        [&](const Node &n, uint32_t, const auto &child)
+        {
+            return n.leaf() ? leaf(n.offset, n.count) :
+                child(&n - nodes + 1) && child(n.offset);
+        }))
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<Mesh> mesh(new Mesh(material, options));
+    BoundingBox box(glm::vec3(header.box[0], header.box[1], header.box[2]),
+        glm::vec3(header.box[3], header.box[4], header.box[5]));
+
+    auto load_wide =
+        [&](auto &wide)
+        {
+            using Wide = std::decay_t<decltype(wide)>;
+            using WideNode = typename Wide::Node;
+
+            if (header.wide_nodes == 0)
+            {
+                return true;
+            }
+
+            auto *n = reinterpret_cast<WideNode *>(wide_nodes);
+
+            if (header.wide_node_size != sizeof(WideNode) ||
+                !valid_tree(n, header.wide_nodes,
+                [&](const WideNode &node, uint32_t i, const auto &child)
+                {
+                    uint32_t offset[Wide::width];
+                    uint32_t count[Wide::width];
+
+                    node.links(i, offset, count);
+
+                    for (size_t c = 0; c < Wide::width; ++c)
+                    {
+                        bool valid = (offset[c] == Wide::none) ||
+                            ((count[c] > 0) ? leaf(offset[c], count[c]) :
+                            child(offset[c]));
+
+                        if (!valid)
+                        {
+                            return false;
+                        }
+                    }
+
+                    return true;
+                }))
+            {
+                return false;
+            }
+
+            wide = Wide(MappedArray<WideNode>(mapping, n, header.wide_nodes),
+                box);
+
+            return true;
+        };
+
+    bool valid =
+        (options.width == 4 && !options.quantized) ? load_wide(mesh->_bvh_4) :
+        (options.width == 8 && !options.quantized) ? load_wide(mesh->_bvh_8) :
+        (options.width == 4) ? load_wide(mesh->_bvh_4_quantized) :
+        (options.width == 8) ? load_wide(mesh->_bvh_8_quantized) :
+        header.wide_nodes == 0;
+
+    if (!valid)
+    {
+        return nullptr;
+    }
+
+    mesh->_vertices.assign(vertices, vertices + header.vertices);
+    mesh->_built_sah_cost = header.built_sah_cost;
+    mesh->_bvh = BVH<Triangle>(std::vector<Node>(nodes, nodes + header.nodes),
+        std::vector<Triangle>(triangles, triangles + header.triangles));
+    mesh->_triangle_blocks = TriangleBlocks(
+        MappedArray<Block>(mapping, blocks, header.blocks),
+        MappedArray<uint32_t>(mapping, first, header.triangles));
+
+    return mesh;
+}
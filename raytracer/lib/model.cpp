@@ -4,18 +4,44 @@
 #include <glm/vec3.hpp>
 
 #include "model.h"
+#include "mesh_cache.h"
 
-bool Model::load(const std::string &f_name, const Material *material)
+bool Model::load(const std::string &f_name, const Material *material,
+    const BVHOptions &bvh_options)
 {
-    std::ifstream in;
+    std::string cache_path = f_name + ".bvh";
+    std::optional<uint64_t> key;
 
-    in.open(f_name, std::ifstream::in);
+    // The key comes from the size and modification time of the model, so
+    // a cached mesh is used without reading the model at all.
+    if (bvh_options.cache)
+    {
+        key = MeshCache::key(f_name, bvh_options);
+
+        if (key)
+        {
+            _mesh = MeshCache::load(cache_path, *key, material, bvh_options);
+
+            if (_mesh)
+            {
+                return true;
+            }
+        }
+    }
 
-    if (in.fail())
+    std::ifstream file;
+
+    file.open(f_name, std::ifstream::in | std::ifstream::binary);
+
+    if (file.fail())
     {
         return false;
     }
 
+    std::string data((std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    std::istringstream in(data);
+
     std::vector<Triangle> triangles;
     std::vector<glm::dvec3> p_vertices;
     std::vector<glm::dvec3> n_vertices;
@@ -56,7 +82,7 @@ bool Model::load(const std::string &f_name, const Material *material)
         }
         else if (!line.compare(0, 3, "vn "))
         {
-            iss >> trash;
+            iss >> trash >> trash;
 
             glm::dvec3 n;
 
@@ -86,7 +112,13 @@ bool Model::load(const std::string &f_name, const Material *material)
         );
     }
 
-    _mesh = std::unique_ptr<Mesh>(new Mesh(vertices, triangles, material));
+    _mesh = std::unique_ptr<Mesh>(new Mesh(vertices, triangles, material,
+        bvh_options));
+
+    if (key)
+    {
+        MeshCache::save(cache_path, *key, *_mesh);
+    }
 
     return true;
 }
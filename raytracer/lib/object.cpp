@@ -1,144 +1,235 @@
 #include <cmath>
 #include <algorithm>
+#include <tuple>
 
 #include <glm/gtx/norm.hpp>
 
 #include "object.h"
 
-std::optional<Intersection> Sphere::find_intersection(const Ray &r) const
+bool Object::occluded(const Ray &r, double t_max) const
 {
-    glm::dvec3 l = r.origin() - _center;
-    double a = glm::dot(r.direction(), r.direction());
-    double b = 2.0d * glm::dot(r.direction(), l);
-    double c = glm::dot(l, l) - _radius * _radius;
+    Hit hit;
 
-    double d = b * b - 4 * c * a;
+    hit.distance = t_max;
 
-    if (d < 0)
+    return intersect(r, hit);
+}
+
+std::optional<Intersection> Object::find_intersection(const Ray &r) const
+{
+    Hit hit;
+
+    if (!intersect(r, hit))
     {
         return std::nullopt;
     }
 
-    double t_0 = -(b + std::sqrt(d)) / (2 * a);
-    double t_1 = -(b - std::sqrt(d)) / (2 * a);
+    return intersection(r, hit);
+}
+
+std::optional<BoundingBox> Object::bounds() const
+{
+    return std::nullopt;
+}
+
+std::optional<SurfaceSample> Object::sample(const glm::dvec2 &) const
+{
+    return std::nullopt;
+}
+
+double SurfaceSample::solid_angle_pdf(const glm::dvec3 &from) const
+{
+    glm::dvec3 d = point - from;
+    double distance_2 = glm::dot(d, d);
+    double cosine = std::abs(glm::dot(normal, d)) / std::sqrt(distance_2);
+
+    return (cosine > 0.0d) ? pdf * distance_2 / cosine :
+        std::numeric_limits<double>::infinity();
+}
+
+void orthonormal_basis(const glm::dvec3 &n, glm::dvec3 &u, glm::dvec3 &v)
+{
+    double sign = std::copysign(1.0d, n.z);
+    double a = -1.0d / (sign + n.z);
+    double b = n.x * n.y * a;
+
+    u = glm::dvec3(1.0d + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    v = glm::dvec3(b, sign + n.y * n.y * a, -n.y);
+}
+
+std::optional<BoundingBox> Sphere::bounds() const
+{
+    return BoundingBox::enclosing(_center - _radius, _center + _radius);
+}
+
+Sphere::Packed<double> Sphere::pack() const
+{
+    return { simd::splat<double>(glm::dvec3(_center)), _radius };
+}
+
+bool Sphere::intersect(const Ray &r, Hit &hit) const
+{
+    double t = distance(packed(), simd::splat<double>(r.origin()),
+        simd::splat<double>(glm::dvec3(r.direction())), hit.distance);
 
-    if (t_0 > t_1)
+    if (!(t < hit.distance))
     {
-        std::swap(t_0, t_1);
+        return false;
     }
 
-    if (t_0 < 0)
-    {
-        t_0 = t_1;
+    hit.distance = t;
+    hit.object = this;
 
-        if (t_0 < 0)
-        {
-            return std::nullopt;
-        }
-    }
+    return true;
+}
 
-    glm::dvec3 point = r.origin() + t_0 * r.direction();
+Intersection Sphere::intersection(const Ray &r, const Hit &hit) const
+{
+    glm::dvec3 point = r.origin() + hit.distance * glm::dvec3(r.direction());
 
     return Intersection
     (
         point,
-        glm::normalize(point - _center),
-        t_0,
-        material()
+        glm::normalize(point - glm::dvec3(_center)),
+        hit.distance,
+        material(),
+        this
     );
 }
 
-std::optional<Intersection> Plane::find_intersection(const Ray &r) const
+Plane::Packed<double> Plane::pack() const
 {
-    double denominator = glm::dot(r.direction(), _normal);
+    glm::dvec3 normal = _normal;
 
-    if (std::abs(denominator) < 1e-3d)
+    return
     {
-        return std::nullopt;
-    }
+        simd::splat<double>(normal),
+        glm::dot(glm::dvec3(_point), -normal)
+    };
+}
 
-    double d = glm::dot(_point, -_normal);
-    double t = -(d + glm::dot(r.origin(), _normal)) / denominator;
+bool Plane::intersect(const Ray &r, Hit &hit) const
+{
+    double t = distance(packed(), simd::splat<double>(r.origin()),
+        simd::splat<double>(glm::dvec3(r.direction())), hit.distance);
 
-    if (t < 0)
+    if (!(t < hit.distance))
     {
-        return std::nullopt;
+        return false;
     }
 
-    return Intersection(r.origin() + t * r.direction(), _normal,
-        t, material());
+    hit.distance = t;
+    hit.object = this;
+
+    return true;
 }
 
-std::optional<Intersection> Mesh::find_intersection(const Ray &r) const
+Intersection Plane::intersection(const Ray &r, const Hit &hit) const
 {
-    double distance = std::numeric_limits<double>::infinity();
-    std::optional<Intersection> intersection = std::nullopt;
+    return Intersection(r.origin() + hit.distance * glm::dvec3(r.direction()),
+        _normal, hit.distance, material(), this);
+}
 
-    _bvh.search
-    (
-        r,
-        [&](auto &o)
+bool Mesh::intersect(const Ray &r, Hit &hit) const
+{
+    // The transform into ray space is set up at the first leaf reached, so
+    // rays that miss the mesh do not pay for it.
+    std::optional<TriangleBlocks::Shear> shear;
+    TriangleBlocks::Hit nearest;
+    bool found = false;
+
+    // Only hits closer than the one the caller already has are of use, so
+    // the kernel starts from its distance and the traversal bound never
+    // rises above it.
+    nearest.t = static_cast<float>(hit.distance);
+
+    auto closest =
+        [&](uint32_t offset, uint32_t count, double &t_max)
         {
-            auto new_intersection = find_intersection(r, o);
+            if (!shear)
+            {
+                shear = TriangleBlocks::shear(r);
+            }
 
-            if (new_intersection && new_intersection->distance() < distance)
+            if (_triangle_blocks.intersect(*shear, offset, count, nearest))
             {
-                distance = new_intersection->distance();
-                intersection = new_intersection;
+                t_max = std::min(t_max, static_cast<double>(nearest.t));
+                found = true;
             }
-        }
-    );
+        };
 
-    return intersection;
-}
+    if (!with_wide_bvh([&](const auto &wide)
+        {
+            wide.intersect_leaves(r, hit.distance, closest);
+        }))
+    {
+        _bvh.intersect_leaves(r, hit.distance, closest);
+    }
 
-std::optional<Intersection> Mesh::find_intersection(const Ray &r,
-    const Triangle &t) const
-{
-    const auto &a = _vertices[t.a];
-    const auto &b = _vertices[t.b];
-    const auto &c = _vertices[t.c];
+    if (!found || !(nearest.t < hit.distance))
+    {
+        return false;
+    }
 
-    auto ab = b.position - a.position;
-    auto ac = c.position - a.position;
+    hit.distance = nearest.t;
+    hit.primitive = nearest.index;
+    hit.uv = glm::vec2(nearest.u, nearest.v);
+    hit.object = this;
 
-    auto p_vec = glm::cross(r.direction(), ac);
-    double d = glm::dot(ab, p_vec);
+    return true;
+}
 
-    if (std::abs(d) <= 1e-5f)
-    {
-        return std::nullopt;
-    }
+Intersection Mesh::intersection(const Ray &r, const Hit &hit) const
+{
+    const Triangle &t = _bvh.objects()[hit.primitive];
+
+    return Intersection(r.origin() + hit.distance * glm::dvec3(r.direction()),
+        glm::normalize(
+        scalar(1.0d - hit.uv.x - hit.uv.y) * _vertices[t.a].normal +
+        scalar(hit.uv.x) * _vertices[t.b].normal +
+        scalar(hit.uv.y) * _vertices[t.c].normal),
+        hit.distance, material(), this);
+}
 
-    double inv_d = 1.0f / d;
+bool Mesh::occluded(const Ray &r, double t_max) const
+{
+    std::optional<TriangleBlocks::Shear> shear;
 
-    auto t_vec = r.origin() - a.position;
-    double u = glm::dot(t_vec, p_vec) * inv_d;
+    auto any =
+        [&](uint32_t offset, uint32_t count)
+        {
+            if (!shear)
+            {
+                shear = TriangleBlocks::shear(r);
+            }
 
-    if (u < 0.0f || u > 1.0f)
-    {
-        return std::nullopt;
-    }
+            return _triangle_blocks.occluded(*shear, offset, count, t_max);
+        };
 
-    auto q_vec = glm::cross(t_vec, ab);
-    double v = glm::dot(r.direction(), q_vec) * inv_d;
+    bool result = false;
 
-    if (v < 0.0f || u + v > 1.0f)
+    if (!with_wide_bvh([&](const auto &wide)
+        {
+            result = wide.occluded_leaves(r, t_max, any);
+        }))
     {
-        return std::nullopt;
+        result = _bvh.occluded_leaves(r, t_max, any);
     }
 
-    double t_0 = glm::dot(ac, q_vec) * inv_d;
+    return result;
+}
+
+std::optional<BoundingBox> Mesh::bounds() const
+{
+    std::optional<BoundingBox> box;
 
-    if (t_0 < 0.0f)
+    if (!with_wide_bvh([&](const auto &wide) { box = wide.box(); }) &&
+        !_bvh.nodes().empty())
     {
-        return std::nullopt;
+        box = _bvh.nodes()[0].box;
     }
 
-    return Intersection(r.origin() + t_0 * r.direction(),
-        glm::normalize((1.0f - u - v) * a.normal +
-        u * b.normal + v * c.normal),
-        t_0, material());
+    return box;
 }
 
 BoundingBox Mesh::calculate_box(const Triangle &t) const
@@ -164,124 +255,576 @@ BoundingBox Mesh::calculate_box(const Triangle &t) const
     );
 }
 
-void Mesh::regen_bvh(size_t delta)
+BoundingBox Mesh::clip_box(const Triangle &t, int axis, float lo,
+        float hi) const
 {
-    _bvh = BVH<Triangle>::construct
-    (
-        ([this]()
+    const glm::dvec3 v[3] =
+    {
+        _vertices[t.a].position,
+        _vertices[t.b].position,
+        _vertices[t.c].position
+    };
+    const double planes[2] = { lo, hi };
+    glm::dvec3 min(std::numeric_limits<double>::infinity());
+    glm::dvec3 max(-std::numeric_limits<double>::infinity());
+
+    auto extend =
+        [&](const glm::dvec3 &p)
+        {
+            min = glm::min(min, p);
+            max = glm::max(max, p);
+        };
+
+    // The clipped polygon consists of the vertices inside the slab and of
+    // the points where the edges cross its planes.
+    for (int i = 0; i < 3; ++i)
+    {
+        const glm::dvec3 &p = v[i];
+        const glm::dvec3 &q = v[(i + 1) % 3];
+
+        if (p[axis] >= lo && p[axis] <= hi)
         {
-            std::vector<Triangle *> ts;
+            extend(p);
+        }
 
-            for (auto &t : _triangles)
+        for (double plane : planes)
+        {
+            if ((p[axis] < plane) != (q[axis] < plane))
             {
-                ts.push_back(&t);
+                glm::dvec3 x = p + (q - p) *
+                    ((plane - p[axis]) / (q[axis] - p[axis]));
+
+                x[axis] = plane;
+                extend(x);
             }
+        }
+    }
+
+    if (min.x > max.x)
+    {
+        return BoundingBox::empty();
+    }
+
+    return BoundingBox::enclosing(min, max);
+}
+
+void Mesh::regen_bvh(std::vector<Triangle> triangles)
+{
+    BVHOptions options = _bvh_options;
+
+    // Quantized nodes count the triangles of a leaf in 8 bits.
+    if (options.quantized)
+    {
+        options.max_leaf_size = std::min(options.max_leaf_size,
+            QuantizedWideNode<4>::max_count);
+    }
 
-            return ts;
-        })(),
-        delta,
+    _bvh = BVH<Triangle>::construct
+    (
+        std::move(triangles),
+        options,
         [this](const auto &t)
         {
             return calculate_box(t);
+        },
+        [this](const auto &t, int axis, float lo, float hi)
+        {
+            return clip_box(t, axis, lo, hi);
         }
     );
+
+    collapse_bvh();
+    _built_sah_cost = bvh_sah_cost();
 }
 
-std::optional<Intersection> Cylinder::find_intersection(const Ray &r) const
+Mesh::Update Mesh::update_vertices(std::vector<Vertex> vertices)
 {
-    double i_rd = glm::l2Norm(r.direction());
-    glm::dvec3 alpha = _axis * glm::dot(r.direction(), _axis);
-    glm::dvec3 delta_p = r.origin() - _bottom_center;
-    glm::dvec3 beta = _axis * glm::dot(delta_p, _axis);
-    glm::dvec3 center = _bottom_center + _axis * _height;
-    double min_t = std::numeric_limits<double>::infinity();
+    if (vertices.size() != _vertices.size())
+    {
+        return REJECTED;
+    }
 
-    double a = glm::l2Norm(r.direction() - alpha);
+    _vertices = std::move(vertices);
 
-    a *= a;
+    auto leaf_box =
+        [this](uint32_t offset, uint32_t count)
+        {
+            BoundingBox box = BoundingBox::empty();
 
-    double b = 2.0d * glm::dot(r.direction() - alpha, delta_p - beta);
-    double c = glm::l2Norm(delta_p - beta);
+            for (uint32_t k = offset; k < offset + count; ++k)
+            {
+                box = BoundingBox::combine(box,
+                    calculate_box(_bvh.objects()[k]));
+            }
 
-    c = c * c - _radius * _radius;
+            return box;
+        };
 
-    double d = b * b - 4 * a * c;
+    _bvh.refit([this](const auto &t) { return calculate_box(t); });
+    _bvh_4.refit(leaf_box);
+    _bvh_8.refit(leaf_box);
+    _bvh_4_quantized.refit(leaf_box);
+    _bvh_8_quantized.refit(leaf_box);
 
-    if (d < 0.0d)
+    if (bvh_sah_cost() > _bvh_options.refit_threshold * _built_sah_cost)
     {
-        return std::nullopt;
+        std::vector<Triangle> triangles = _bvh.objects();
+
+        // Spatial splits reference a triangle from several leaves; keep
+        // one reference of each before building again.
+        if (_bvh_options.builder == BVHOptions::SBVH)
+        {
+            auto key = [](const Triangle &t)
+                { return std::make_tuple(t.a, t.b, t.c); };
+
+            std::sort(triangles.begin(), triangles.end(),
+                [&](const Triangle &a, const Triangle &b)
+                    { return key(a) < key(b); });
+            triangles.erase(std::unique(triangles.begin(), triangles.end(),
+                [&](const Triangle &a, const Triangle &b)
+                    { return key(a) == key(b); }), triangles.end());
+        }
+
+        regen_bvh(std::move(triangles));
+
+        return REBUILT;
     }
-    else
+
+    _triangle_blocks.refit(_bvh.objects(), _vertices);
+
+    return REFIT;
+}
+
+template <typename TFn>
+void Mesh::for_each_leaf(const TFn &fn) const
+{
+    if (with_wide_bvh([&](const auto &wide) { wide.for_each_leaf(fn); }))
     {
-        d = std::sqrt(d);
-		double t_1 = (-b + d) / (2 * a);
-		double t_2 = (-b - d) / (2 * a);
+        return;
+    }
 
-        if (t_1 >= 0.0d)
+    for (const auto &n : _bvh.nodes())
+    {
+        if (n.leaf())
         {
-            if (glm::dot(_axis, (r.origin() - _bottom_center) +
-                r.direction() * t_1) > 0.0d &&
-                glm::dot(_axis, (r.origin() - center) +
-                r.direction() * t_1) < 0.0d &&
-                min_t > t_1)
-            {
-                min_t = t_1;
-            }
+            fn(n.offset, n.count);
         }
-        if (t_2 >= 0)
+    }
+}
+
+void Mesh::collapse_bvh()
+{
+    // A tree that is a single leaf is kept binary: its traversal tests the
+    // root box once, where a wide node would test it again as its only
+    // child.
+    size_t width = (_bvh.nodes().size() > 1) ? _bvh_options.width : 2;
+    bool quantized = _bvh_options.quantized;
+    std::vector<uint32_t> order;
+
+    _bvh_4 = (width == 4 && !quantized) ?
+        WideBVH<4>::collapse(_bvh, order) : WideBVH<4>();
+    _bvh_8 = (width == 8 && !quantized) ?
+        WideBVH<8>::collapse(_bvh, order) : WideBVH<8>();
+    _bvh_4_quantized = (width == 4 && quantized) ?
+        WideBVH<4, true>::collapse(_bvh, order) : WideBVH<4, true>();
+    _bvh_8_quantized = (width == 8 && quantized) ?
+        WideBVH<8, true>::collapse(_bvh, order) : WideBVH<8, true>();
+
+    // The wide tree is the only one traced and refit, so of the binary
+    // tree only the triangles are kept, in the order of the wide leaves.
+    if (!order.empty())
+    {
+        std::vector<Triangle> triangles;
+
+        triangles.reserve(order.size());
+
+        for (uint32_t i : order)
         {
-            if(glm::dot(_axis, (r.origin() - _bottom_center) +
-                r.direction() * t_2) > 0.0d &&
-                glm::dot(_axis, (r.origin() - center) +
-                r.direction() * t_2) < 0.0d &&
-                min_t > t_2)
-            {
-                min_t = t_2;
-            }
+            triangles.push_back(_bvh.objects()[i]);
         }
+
+        _bvh = BVH<Triangle>({}, std::move(triangles));
     }
 
-    double denominator = glm::dot(r.direction(), _axis);
+    _triangle_blocks = TriangleBlocks::build(_bvh.objects(), _vertices,
+        [this](const auto &fn) { for_each_leaf(fn); });
+}
+
+double Mesh::bvh_sah_cost() const
+{
+    double cost = 0.0d;
+
+    if (!with_wide_bvh([&](const auto &wide) { cost = wide.sah_cost(); }))
+    {
+        cost = _bvh.sah_cost();
+    }
+
+    return cost;
+}
+
+size_t Mesh::bvh_memory() const
+{
+    size_t memory = _bvh.memory() + _triangle_blocks.memory();
+
+    with_wide_bvh([&](const auto &wide) { memory += wide.memory(); });
+
+    return memory;
+}
+
+std::optional<BoundingBox> Cylinder::bounds() const
+{
+    // A cap of radius r with unit normal n spans r * sqrt(1 - n_i^2) along
+    // each axis i around its center.
+    glm::dvec3 bottom = _bottom_center;
+    glm::dvec3 axis = _axis;
+    glm::dvec3 top = bottom + axis * double(_height);
+    glm::dvec3 extent = double(_radius) * glm::sqrt(glm::max(glm::dvec3(0),
+        1.0d - axis * axis));
+
+    return BoundingBox::enclosing(glm::min(bottom, top) - extent,
+        glm::max(bottom, top) + extent);
+}
+
+Cylinder::Packed<double> Cylinder::pack() const
+{
+    glm::dvec3 n = _axis;
+    glm::dvec3 u;
+    glm::dvec3 v;
+
+    orthonormal_basis(n, u, v);
+
+    return
+    {
+        simd::splat<double>(glm::dvec3(_bottom_center)),
+        simd::splat<double>(u),
+        simd::splat<double>(v),
+        simd::splat<double>(n),
+        _radius,
+        _height
+    };
+}
+
+bool Cylinder::intersect(const Ray &r, Hit &hit) const
+{
+    double t = distance(packed(), simd::splat<double>(r.origin()),
+        simd::splat<double>(glm::dvec3(r.direction())), hit.distance);
+
+    if (!(t < hit.distance))
+    {
+        return false;
+    }
+
+    hit.distance = t;
+    hit.object = this;
+
+    return true;
+}
+
+Intersection Cylinder::intersection(const Ray &r, const Hit &hit) const
+{
+    glm::dvec3 point = r.origin() + hit.distance * glm::dvec3(r.direction());
+    glm::dvec3 axis = _axis;
+    glm::dvec3 p = point - glm::dvec3(_bottom_center);
+    double z = glm::dot(p, axis);
+    glm::dvec3 radial = p - axis * z;
+
+    // The hit is on the surface it lies closest to.
+    double side = std::abs(glm::length(radial) - _radius);
+    double cap = std::min(std::abs(z), std::abs(z - _height));
+    svec3 normal = (cap < side) ? svec3((z < 0.5d * _height) ? -axis : axis) :
+        svec3(glm::normalize(radial));
+
+    return Intersection(point, normal, hit.distance, material(), this);
+}
+
+Quad::Packed<double> Quad::pack() const
+{
+    // Dual vectors of the edges: dot(p, dual_u) is the coordinate of a
+    // point p of the plane along edge_u, relative to the corner.
+    glm::dvec3 edge_u = _edge_u;
+    glm::dvec3 edge_v = _edge_v;
+    glm::dvec3 n = glm::cross(edge_u, edge_v);
+    glm::dvec3 dual_u = glm::cross(edge_v, n) / glm::dot(n, n);
+    glm::dvec3 dual_v = glm::cross(n, edge_u) / glm::dot(n, n);
+
+    return
+    {
+        simd::splat<double>(glm::dvec3(_corner)),
+        simd::splat<double>(glm::dvec3(_normal)),
+        simd::splat<double>(dual_u),
+        simd::splat<double>(dual_v)
+    };
+}
+
+bool Quad::intersect(const Ray &r, Hit &hit) const
+{
+    double t = distance(packed(), simd::splat<double>(r.origin()),
+        simd::splat<double>(glm::dvec3(r.direction())), hit.distance);
+
+    if (!(t < hit.distance))
+    {
+        return false;
+    }
+
+    hit.distance = t;
+    hit.object = this;
+
+    return true;
+}
+
+Intersection Quad::intersection(const Ray &r, const Hit &hit) const
+{
+    return Intersection(r.origin() + hit.distance * glm::dvec3(r.direction()),
+        _normal, hit.distance, material(), this);
+}
 
-    if (denominator > 1e-5d)
+std::optional<BoundingBox> Quad::bounds() const
+{
+    glm::dvec3 corner = _corner;
+    glm::dvec3 u = corner + glm::dvec3(_edge_u);
+    glm::dvec3 v = corner + glm::dvec3(_edge_v);
+    glm::dvec3 far = u + glm::dvec3(_edge_v);
+
+    return BoundingBox::enclosing(
+        glm::min(glm::min(corner, far), glm::min(u, v)),
+        glm::max(glm::max(corner, far), glm::max(u, v)));
+}
+
+std::optional<SurfaceSample> Quad::sample(const glm::dvec2 &u) const
+{
+    return SurfaceSample
+    {
+        glm::dvec3(_corner) + u.x * glm::dvec3(_edge_u) +
+            u.y * glm::dvec3(_edge_v),
+        _normal,
+        1.0d / area()
+    };
+}
+
+Disk::Packed<double> Disk::pack() const
+{
+    return
     {
-        glm::dvec3 co = _bottom_center - r.origin();
-        double t_3 = glm::dot(co, _axis) / denominator;
+        simd::splat<double>(glm::dvec3(_center)),
+        simd::splat<double>(glm::dvec3(_normal)),
+        _radius
+    };
+}
+
+bool Disk::intersect(const Ray &r, Hit &hit) const
+{
+    double t = distance(packed(), simd::splat<double>(r.origin()),
+        simd::splat<double>(glm::dvec3(r.direction())), hit.distance);
+
+    if (!(t < hit.distance))
+    {
+        return false;
+    }
+
+    hit.distance = t;
+    hit.object = this;
+
+    return true;
+}
+
+Intersection Disk::intersection(const Ray &r, const Hit &hit) const
+{
+    return Intersection(r.origin() + hit.distance * glm::dvec3(r.direction()),
+        _normal, hit.distance, material(), this);
+}
 
-        double l = glm::l2Norm(r.direction() * t_3 - co);
+std::optional<BoundingBox> Disk::bounds() const
+{
+    glm::dvec3 center = _center;
+    glm::dvec3 normal = _normal;
+    glm::dvec3 extent = double(_radius) * glm::sqrt(glm::max(glm::dvec3(0),
+        1.0d - normal * normal));
+
+    return BoundingBox::enclosing(center - extent, center + extent);
+}
 
-        if(t_3 > 0.0d && l * l <= _radius * _radius &&
-            min_t > t_3)
+std::optional<SurfaceSample> Disk::sample(const glm::dvec2 &u) const
+{
+    // The concentric map of Shirley and Chiu keeps the strata of u compact
+    // on the disk.
+    const double pi = std::acos(-1.0d);
+    double a = 2.0d * u.x - 1.0d;
+    double b = 2.0d * u.y - 1.0d;
+    double radius = 0.0d;
+    double angle = 0.0d;
+
+    if (a != 0.0d || b != 0.0d)
+    {
+        if (std::abs(a) > std::abs(b))
+        {
+            radius = a;
+            angle = 0.25d * pi * b / a;
+        }
+        else
         {
-            min_t = t_3;
+            radius = b;
+            angle = 0.5d * pi - 0.25d * pi * a / b;
         }
     }
-    else if (denominator < 1e-5d)
+
+    return SurfaceSample
     {
-        glm::dvec3 co = center - r.origin();
-        double t_4 = glm::dot(co, _axis) / denominator;
+        glm::dvec3(_center) + double(_radius) * radius *
+            (std::cos(angle) * glm::dvec3(_u) +
+            std::sin(angle) * glm::dvec3(_v)),
+        _normal,
+        1.0d / area()
+    };
+}
+
+double Box::area() const
+{
+    glm::dvec3 h = _half_extent;
 
-        double l = glm::l2Norm(r.direction() * t_4 - co);
+    return 8.0d * (h.x * h.y + h.y * h.z + h.z * h.x);
+}
 
-        if (t_4 > 0.0d && l * l <= _radius * _radius &&
-            min_t > t_4)
+Box::Packed<double> Box::pack() const
+{
+    return
+    {
+        simd::splat<double>(glm::dvec3(_center)),
         {
-            min_t = t_4;
-        }
+            simd::splat<double>(glm::dvec3(_axes[0])),
+            simd::splat<double>(glm::dvec3(_axes[1])),
+            simd::splat<double>(glm::dvec3(_axes[2]))
+        },
+        simd::splat<double>(glm::dvec3(_half_extent))
+    };
+}
+
+bool Box::intersect(const Ray &r, Hit &hit) const
+{
+    double t = distance(packed(), simd::splat<double>(r.origin()),
+        simd::splat<double>(glm::dvec3(r.direction())), hit.distance);
+
+    if (!(t < hit.distance))
+    {
+        return false;
+    }
+
+    hit.distance = t;
+    hit.object = this;
+
+    return true;
+}
+
+Intersection Box::intersection(const Ray &r, const Hit &hit) const
+{
+    glm::dvec3 point = r.origin() + hit.distance * glm::dvec3(r.direction());
+    glm::dmat3 axes = _axes;
+    glm::dvec3 p = glm::transpose(axes) * (point - glm::dvec3(_center)) /
+        glm::dvec3(_half_extent);
+    int i = (std::abs(p.x) > std::abs(p.y)) ?
+        ((std::abs(p.x) > std::abs(p.z)) ? 0 : 2) :
+        ((std::abs(p.y) > std::abs(p.z)) ? 1 : 2);
+    glm::dvec3 normal = axes[i] * ((p[i] < 0) ? -1.0d : 1.0d);
+
+    return Intersection(point, svec3(normal), hit.distance, material(), this);
+}
+
+std::optional<BoundingBox> Box::bounds() const
+{
+    glm::dmat3 axes = _axes;
+    glm::dvec3 h = _half_extent;
+    glm::dvec3 center = _center;
+    glm::dvec3 extent = glm::abs(axes[0]) * h.x + glm::abs(axes[1]) * h.y +
+        glm::abs(axes[2]) * h.z;
+
+    return BoundingBox::enclosing(center - extent, center + extent);
+}
+
+std::optional<SurfaceSample> Box::sample(const glm::dvec2 &u) const
+{
+    // A face is picked with probability proportional to its area and u.x
+    // is rescaled to a coordinate on it.
+    glm::dmat3 axes = _axes;
+    glm::dvec3 h = _half_extent;
+    const double faces[3] = { h.y * h.z, h.z * h.x, h.x * h.y };
+    double x = u.x * 2.0d * (faces[0] + faces[1] + faces[2]);
+    int face = 0;
+
+    while (face < 5 && x >= faces[face / 2])
+    {
+        x -= faces[face / 2];
+        ++face;
     }
 
-    if (min_t < std::numeric_limits<double>::infinity())
+    int axis = face / 2;
+    double sign = (face % 2) ? 1.0d : -1.0d;
+    glm::dvec3 p;
+
+    p[axis] = sign * h[axis];
+    p[(axis + 1) % 3] = (2.0d * std::min(x / faces[axis], 1.0d) - 1.0d) *
+        h[(axis + 1) % 3];
+    p[(axis + 2) % 3] = (2.0d * u.y - 1.0d) * h[(axis + 2) % 3];
+
+    return SurfaceSample
     {
-        double t = min_t / i_rd;
+        glm::dvec3(_center) + axes * p,
+        axes[axis] * sign,
+        1.0d / area()
+    };
+}
 
-        glm::dvec3 point = r.origin() + (min_t / i_rd) * r.direction();
-        glm::dvec3 normal = glm::normalize(glm::cross(
-            _axis, glm::cross(point - _bottom_center, _axis)));
+// The direction is transformed without normalization, so ray parameters,
+// and therefore distances and t_max, are the same in both spaces.
+Ray Instance::to_object(const Ray &r) const
+{
+    return Ray(glm::dvec3(_inverse * glm::dvec4(r.origin(), 1.0d)),
+        glm::dvec3(_inverse * glm::dvec4(glm::dvec3(r.direction()), 0.0d)));
+}
 
-        return Intersection(point, normal, t, material());
+bool Instance::intersect(const Ray &r, Hit &hit) const
+{
+    if (!_mesh->intersect(to_object(r), hit))
+    {
+        return false;
     }
-    else
+
+    hit.object = this;
+
+    return true;
+}
+
+Intersection Instance::intersection(const Ray &r, const Hit &hit) const
+{
+    Intersection local = _mesh->intersection(to_object(r), hit);
+
+    return Intersection(r.origin() + hit.distance * glm::dvec3(r.direction()),
+        glm::normalize(_normal_matrix * local.normal()),
+        hit.distance, material(), this);
+}
+
+bool Instance::occluded(const Ray &r, double t_max) const
+{
+    return _mesh->occluded(to_object(r), t_max);
+}
+
+std::optional<BoundingBox> Instance::bounds() const
+{
+    std::optional<BoundingBox> box = _mesh->bounds();
+
+    if (!box)
     {
         return std::nullopt;
     }
+
+    glm::dvec3 min(std::numeric_limits<double>::infinity());
+    glm::dvec3 max(-std::numeric_limits<double>::infinity());
+
+    for (const auto &c : box->corners())
+    {
+        glm::dvec3 p = glm::dvec3(_transform * glm::dvec4(c, 1.0d));
+
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    return BoundingBox::enclosing(min, max);
 }
@@ -130,18 +130,22 @@ glm::dvec3 Renderer::render_ray(const Scene &scene, const Ray &ray,
         return glm::dvec3(0.2, 0.7, 0.8);
     }
 
-    glm::dvec3 reflection_direction = reflect(ray.direction(), i->normal());
+    // Shading is done in double whatever the precision of the geometry.
+    glm::dvec3 direction = ray.direction();
+    glm::dvec3 normal = i->normal();
+
+    glm::dvec3 reflection_direction = reflect(direction, normal);
     glm::dvec3 reflection_origin = i->point() +
-        ((glm::dot(reflection_direction, i->normal()) < 0) ?
-            -i->normal() : i->normal()) * 1e-3d;
+        ((glm::dot(reflection_direction, normal) < 0) ?
+            -normal : normal) * 1e-3d;
     Ray reflection = Ray(reflection_origin, reflection_direction);
     glm::dvec3 reflection_color = render_ray(scene, reflection, recursion + 1);
 
-    glm::dvec3 refraction_direction = refract(ray.direction(), i->normal(),
+    glm::dvec3 refraction_direction = refract(direction, normal,
         i->material()->refractive_index());
     glm::dvec3 refraction_origin = i->point() +
-        ((glm::dot(refraction_direction, i->normal()) < 0) ?
-            -i->normal() : i->normal()) * 1e-3d;
+        ((glm::dot(refraction_direction, normal) < 0) ?
+            -normal : normal) * 1e-3d;
     Ray refraction = Ray(refraction_origin, refraction_direction);
     glm::dvec3 refraction_color = render_ray(scene, refraction, recursion + 1);
 
@@ -156,24 +160,21 @@ glm::dvec3 Renderer::render_ray(const Scene &scene, const Ray &ray,
             o->position() - i->point());
 
         glm::dvec3 shadow_origin = i->point() +
-            ((glm::dot(light_direction, i->normal()) < 0) ?
-                -i->normal() : i->normal()) * 1e-3d;
-
-        std::optional<Intersection> intersection =
-            scene.find_intersection(Ray(shadow_origin, light_direction));
+            ((glm::dot(light_direction, normal) < 0) ?
+                -normal : normal) * 1e-3d;
 
-        if (intersection && glm::l2Norm(
-            intersection->point() - shadow_origin) < light_distance)
+        if (scene.occluded(Ray(shadow_origin, light_direction),
+            light_distance))
         {
             continue;
         }
 
         diffuse_light_intensity += o->intensity() *
             std::max(0.0d, glm::dot(light_direction,
-            i->normal()));
+            normal));
         specular_light_intensity += std::pow(
             std::max(0.0d, glm::dot(reflect(
-            light_direction, i->normal()), ray.direction())),
+            light_direction, normal), direction)),
             i->material()->specular_exponent()) * o->intensity();
     }
 
@@ -188,7 +189,7 @@ glm::dvec3 Renderer::render_ray(const Scene &scene, const Ray &ray,
 }
 
 glm::dvec3 Renderer::render_path(const Scene &scene, const Ray &ray,
-    unsigned recursion, unsigned max_recursion) const
+    unsigned recursion, unsigned max_recursion, bool count_emission) const
 {
     std::optional<Intersection> i = scene.find_intersection(ray);
 
@@ -197,7 +198,12 @@ glm::dvec3 Renderer::render_path(const Scene &scene, const Ray &ray,
         return glm::dvec3(0.2, 0.7, 0.8);
     }
 
+    glm::dvec3 direction = ray.direction();
+    glm::dvec3 normal = i->normal();
+
     glm::dvec3 color = i->material()->diffuse_color();
+    glm::dvec3 emission = (count_emission || !i->object()->light()) ?
+        i->material()->emission() : glm::dvec3(0);
     double p = std::max(color.x, std::max(color.y, color.z));
 
     if (recursion > max_recursion)
@@ -208,13 +214,13 @@ glm::dvec3 Renderer::render_path(const Scene &scene, const Ray &ray,
         }
         else
         {
-            return i->material()->emission();
+            return emission;
         }
     }
 
-    glm::dvec3 n = (glm::dot(ray.direction(), i->normal()) < 0) ?
-        i->normal() : -i->normal();
-    Ray reflected = Ray(i->point(), reflect(ray.direction(), i->normal()));
+    glm::dvec3 n = (glm::dot(direction, normal) < 0) ?
+        normal : -normal;
+    Ray reflected = Ray(i->point(), reflect(direction, normal));
 
     if (i->material()->type() == Material::DIFFUSE)
     {
@@ -230,42 +236,43 @@ glm::dvec3 Renderer::render_path(const Scene &scene, const Ray &ray,
             (u * std::cos(r_1) * r_2_s + v * std::sin(r_1) * r_2_s +
             n * std::sqrt(1 - r_2)));
 
-        return i->material()->emission() + color *
-            render_path(scene, Ray(i->point(), d), recursion + 1);
+        return emission + color * sample_lights(scene, *i, n) + color *
+            render_path(scene, Ray(i->point(), d), recursion + 1,
+            max_recursion, scene.lights().empty());
     }
     else if (i->material()->type() == Material::SPECULAR)
     {
-        return i->material()->emission() + color *
+        return emission + color *
             render_path(scene, reflected, recursion + 1);
     }
 
-    bool outside = glm::dot(n, i->normal()) > 0;
+    bool outside = glm::dot(n, normal) > 0;
     double nc = 1;
     double nt = 1.5;
     double nnt = (outside) ? nc / nt : nt / nc;
-    double ddn = glm::dot(ray.direction(), n);
+    double ddn = glm::dot(direction, n);
     double cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
     
     if (cos2t < 0)
     {
-        return i->material()->emission() + color *
+        return emission + color *
             render_path(scene, reflected, recursion + 1);
     }
 
-    glm::dvec3 t_dir = glm::normalize(ray.direction() * nnt - i->normal() *
+    glm::dvec3 t_dir = glm::normalize(direction * nnt - normal *
         ((outside) ? 1.0d : -1.0d) * (ddn * nnt + std::sqrt(cos2t)));
     
     double a = nt - nc;
     double b = nt + nc;
     double r_0 = a * a / (b * b);
-    double c = 1 - ((outside) ? -ddn : glm::dot(t_dir, i->normal()));
+    double c = 1 - ((outside) ? -ddn : glm::dot(t_dir, normal));
     double r_e = r_0 + (1 - r_0) * std::pow(c, 5);
     double t_r = 1 - r_e;
     double p_i = 0.25 + 0.5 * r_e;
     double r_p = r_e / p_i;
     double t_p = t_r / (1 - p_i);
     
-    return i->material()->emission() + color *
+    return emission + color *
         ((recursion > 1) ? ((erand48() < p_i) ?
         render_path(scene, reflected, recursion + 1) * r_p :
         render_path(scene, reflected, recursion + 1) * t_p) :
@@ -273,6 +280,52 @@ glm::dvec3 Renderer::render_path(const Scene &scene, const Ray &ray,
         render_path(scene, Ray(i->point(), t_dir), recursion + 1) * t_r);
 }
 
+// Radiance reaching a diffuse point from one sample on each light, divided
+// by the albedo: Le cos_s cos_l / (pi d^2 pdf), where pdf is per unit area
+// of the light.
+glm::dvec3 Renderer::sample_lights(const Scene &scene, const Intersection &i,
+    const glm::dvec3 &n) const
+{
+    glm::dvec3 r = glm::dvec3(0);
+
+    for (const Object *light : scene.lights())
+    {
+        double u_1 = erand48();
+        double u_2 = erand48();
+        std::optional<SurfaceSample> s = light->sample(glm::dvec2(u_1, u_2));
+
+        glm::dvec3 to_light = s->point - i.point();
+        double distance_2 = glm::dot(to_light, to_light);
+        double distance = std::sqrt(distance_2);
+        glm::dvec3 w = to_light / distance;
+        double cos_s = glm::dot(n, w);
+        double cos_l = std::abs(glm::dot(s->normal, w));
+
+        if (cos_s <= 0 || cos_l <= 0)
+        {
+            continue;
+        }
+
+        // The shadow ray runs from off the surface to the sampled point and
+        // stops short of it by a fraction of its length, which unlike a
+        // fixed distance scales with the scene.
+        glm::dvec3 shadow_origin = i.point() + n * 1e-3d;
+        glm::dvec3 shadow = s->point - shadow_origin;
+        double shadow_distance = glm::length(shadow);
+
+        if (scene.occluded(Ray(shadow_origin, shadow / shadow_distance),
+            shadow_distance * (1.0d - 1e-4d)))
+        {
+            continue;
+        }
+
+        r += light->material()->emission() * cos_s * cos_l /
+            (std::acos(-1) * distance_2 * s->pdf);
+    }
+
+    return r;
+}
+
 glm::dvec3 Renderer::reflect(const glm::dvec3 &indice, const glm::dvec3 &normal)
     const
 {
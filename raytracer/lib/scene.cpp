@@ -1,23 +1,449 @@
+#include <algorithm>
 #include <limits>
 
 #include "scene.h"
 
-std::optional<Intersection> Scene::find_intersection(const Ray &ray) const
+void Scene::build_bvh(const BVHOptions &options)
 {
-    double closest = std::numeric_limits<double>::infinity();
-    std::optional<Intersection> intersection = std::nullopt;
+    std::vector<const Sphere *> spheres;
+    std::vector<const Cylinder *> cylinders;
+    std::vector<const Plane *> planes;
+    std::vector<const Quad *> quads;
+    std::vector<const Disk *> disks;
+    std::vector<const Box *> boxes;
+    std::vector<const Object *> bounded;
+    std::vector<PrimitiveRef> refs;
+
+    _unbounded.clear();
+    _lights.clear();
+    _flat = false;
 
     for (const auto &o : _objects)
     {
-        std::optional<Intersection> new_intersection =
-            o->find_intersection(ray);
+        o->set_light(o->material()->emission() != glm::dvec3(0) &&
+            o->sample(glm::dvec2(0.5d)));
+
+        if (o->light())
+        {
+            _lights.push_back(o.get());
+        }
+
+        if (const auto *sphere = dynamic_cast<const Sphere *>(o.get()))
+        {
+            refs.push_back({ PrimitiveRef::SPHERE,
+                static_cast<uint32_t>(spheres.size()) });
+            spheres.push_back(sphere);
+        }
+        else if (const auto *cylinder =
+            dynamic_cast<const Cylinder *>(o.get()))
+        {
+            refs.push_back({ PrimitiveRef::CYLINDER,
+                static_cast<uint32_t>(cylinders.size()) });
+            cylinders.push_back(cylinder);
+        }
+        else if (const auto *plane = dynamic_cast<const Plane *>(o.get()))
+        {
+            planes.push_back(plane);
+        }
+        else if (const auto *quad = dynamic_cast<const Quad *>(o.get()))
+        {
+            refs.push_back({ PrimitiveRef::QUAD,
+                static_cast<uint32_t>(quads.size()) });
+            quads.push_back(quad);
+        }
+        else if (const auto *disk = dynamic_cast<const Disk *>(o.get()))
+        {
+            refs.push_back({ PrimitiveRef::DISK,
+                static_cast<uint32_t>(disks.size()) });
+            disks.push_back(disk);
+        }
+        else if (const auto *box = dynamic_cast<const Box *>(o.get()))
+        {
+            refs.push_back({ PrimitiveRef::BOX,
+                static_cast<uint32_t>(boxes.size()) });
+            boxes.push_back(box);
+        }
+        else if (o->bounds())
+        {
+            refs.push_back({ PrimitiveRef::OBJECT,
+                static_cast<uint32_t>(bounded.size()) });
+            bounded.push_back(o.get());
+        }
+        else
+        {
+            _unbounded.push_back(o.get());
+        }
+    }
+
+    auto bounds =
+        [&](const PrimitiveRef &p)
+        {
+            switch (p.type)
+            {
+                case PrimitiveRef::SPHERE:
+                    return *spheres[p.index]->bounds();
+
+                case PrimitiveRef::CYLINDER:
+                    return *cylinders[p.index]->bounds();
+
+                case PrimitiveRef::QUAD:
+                    return *quads[p.index]->bounds();
+
+                case PrimitiveRef::DISK:
+                    return *disks[p.index]->bounds();
+
+                case PrimitiveRef::BOX:
+                    return *boxes[p.index]->bounds();
+
+                default:
+                    return *bounded[p.index]->bounds();
+            }
+        };
+
+    BVH<PrimitiveRef> bvh;
+
+    // A few objects are kept in a single leaf: testing them all costs less
+    // than the boxes of a tree over them. Each type then makes one run, so
+    // its pool has no empty slots.
+    if (!refs.empty() && refs.size() <= max_flat_objects)
+    {
+        BVH<PrimitiveRef>::Node root { BoundingBox::empty(), 0,
+            static_cast<uint16_t>(refs.size()), 0 };
+
+        for (const PrimitiveRef &p : refs)
+        {
+            root.box = BoundingBox::combine(root.box, bounds(p));
+        }
+
+        bvh = BVH<PrimitiveRef>({ root }, std::move(refs));
+        _flat = true;
+    }
+    else
+    {
+        bvh = BVH<PrimitiveRef>::construct(std::move(refs), options, bounds);
+    }
+
+    // The entries are renumbered in leaf order, sorted by type within a
+    // leaf. A run of pooled primitives that fits in a block is moved to
+    // the start of a new one, so that most leaves take one kernel call per
+    // type.
+    std::vector<PrimitiveRef> ordered = bvh.objects();
+    std::vector<const Sphere *> sphere_slots;
+    std::vector<const Cylinder *> cylinder_slots;
+    std::vector<const Quad *> quad_slots;
+    std::vector<const Disk *> disk_slots;
+    std::vector<const Box *> box_slots;
+    std::vector<const Object *> bounded_slots;
+
+    auto place =
+        [](auto &slots, const auto &source, PrimitiveRef *run, size_t n,
+            size_t width)
+        {
+            if (n <= width && slots.size() % width + n > width)
+            {
+                slots.resize((slots.size() / width + 1) * width, nullptr);
+            }
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                slots.push_back(source[run[i].index]);
+                run[i].index = slots.size() - 1;
+            }
+        };
+
+    for (const auto &node : bvh.nodes())
+    {
+        if (!node.leaf())
+        {
+            continue;
+        }
+
+        PrimitiveRef *first = ordered.data() + node.offset;
+        PrimitiveRef *last = first + node.count;
+
+        std::stable_sort(first, last,
+            [](const PrimitiveRef &a, const PrimitiveRef &b)
+            {
+                return a.type < b.type;
+            });
 
-        if (new_intersection && new_intersection->distance() < closest)
+        while (first != last)
         {
-            closest = new_intersection->distance();
-            intersection = new_intersection;
+            PrimitiveRef *end = std::find_if(first, last,
+                [&](const PrimitiveRef &p)
+                {
+                    return p.type != first->type;
+                });
+
+            switch (first->type)
+            {
+                case PrimitiveRef::SPHERE:
+                    place(sphere_slots, spheres, first, end - first,
+                        simd::width);
+                    break;
+
+                case PrimitiveRef::CYLINDER:
+                    place(cylinder_slots, cylinders, first, end - first,
+                        simd::width);
+                    break;
+
+                case PrimitiveRef::QUAD:
+                    place(quad_slots, quads, first, end - first,
+                        simd::width);
+                    break;
+
+                case PrimitiveRef::DISK:
+                    place(disk_slots, disks, first, end - first,
+                        simd::width);
+                    break;
+
+                case PrimitiveRef::BOX:
+                    place(box_slots, boxes, first, end - first,
+                        simd::width);
+                    break;
+
+                default:
+                    place(bounded_slots, bounded, first, end - first, 1);
+                    break;
+            }
+
+            first = end;
         }
     }
 
-    return intersection;
+    _spheres = PrimitivePool<Sphere>::build(std::move(sphere_slots));
+    _cylinders = PrimitivePool<Cylinder>::build(std::move(cylinder_slots));
+    _planes = PrimitivePool<Plane>::build(std::move(planes));
+    _quads = PrimitivePool<Quad>::build(std::move(quad_slots));
+    _disks = PrimitivePool<Disk>::build(std::move(disk_slots));
+    _boxes = PrimitivePool<Box>::build(std::move(box_slots));
+    _bounded = std::move(bounded_slots);
+    _bvh = BVH<PrimitiveRef>(bvh.nodes(), std::move(ordered));
+}
+
+void Scene::refit_bvh()
+{
+    _bvh.refit
+    (
+        [this](const PrimitiveRef &p)
+        {
+            return *object(p)->bounds();
+        }
+    );
+}
+
+const Object *Scene::object(const PrimitiveRef &p) const
+{
+    switch (p.type)
+    {
+        case PrimitiveRef::SPHERE:
+            return _spheres.objects()[p.index];
+
+        case PrimitiveRef::CYLINDER:
+            return _cylinders.objects()[p.index];
+
+        case PrimitiveRef::QUAD:
+            return _quads.objects()[p.index];
+
+        case PrimitiveRef::DISK:
+            return _disks.objects()[p.index];
+
+        case PrimitiveRef::BOX:
+            return _boxes.objects()[p.index];
+
+        default:
+            return _bounded[p.index];
+    }
+}
+
+// Calls fn(type, first, count) for each run of entries of a leaf with the
+// same type and consecutive slots, until it returns true.
+template <typename TFn>
+bool Scene::for_each_run(uint32_t offset, uint32_t count, const TFn &fn)
+    const
+{
+    const std::vector<PrimitiveRef> &refs = _bvh.objects();
+    uint32_t end = offset + count;
+
+    while (offset < end)
+    {
+        const PrimitiveRef &p = refs[offset];
+        uint32_t n = 1;
+
+        while (offset + n < end && refs[offset + n].type == p.type &&
+            refs[offset + n].index == p.index + n)
+        {
+            ++n;
+        }
+
+        if (fn(p.type, p.index, n))
+        {
+            return true;
+        }
+
+        offset += n;
+    }
+
+    return false;
+}
+
+std::optional<Intersection> Scene::find_intersection(const Ray &ray) const
+{
+    Hit hit;
+    PackedRay packed(ray);
+
+    auto nearest =
+        [&](uint32_t offset, uint32_t count, double &t_max)
+        {
+            for_each_run(offset, count,
+                [&](PrimitiveRef::Type type, uint32_t first, uint32_t n)
+                {
+                    switch (type)
+                    {
+                        case PrimitiveRef::SPHERE:
+                            _spheres.intersect(packed, first, n, hit);
+                            break;
+
+                        case PrimitiveRef::CYLINDER:
+                            _cylinders.intersect(packed, first, n, hit);
+                            break;
+
+                        case PrimitiveRef::QUAD:
+                            _quads.intersect(packed, first, n, hit);
+                            break;
+
+                        case PrimitiveRef::DISK:
+                            _disks.intersect(packed, first, n, hit);
+                            break;
+
+                        case PrimitiveRef::BOX:
+                            _boxes.intersect(packed, first, n, hit);
+                            break;
+
+                        default:
+                            for (uint32_t i = first; i < first + n; ++i)
+                            {
+                                _bounded[i]->intersect(ray, hit);
+                            }
+                            break;
+                    }
+
+                    return false;
+                });
+
+            t_max = hit.distance;
+        };
+
+    _planes.intersect(packed, hit);
+
+    for (const Object *o : _unbounded)
+    {
+        o->intersect(ray, hit);
+    }
+
+    // The pools of a scene kept in a single leaf are tested whole, without
+    // a traversal.
+    if (_flat)
+    {
+        _spheres.intersect(packed, hit);
+        _cylinders.intersect(packed, hit);
+        _quads.intersect(packed, hit);
+        _disks.intersect(packed, hit);
+        _boxes.intersect(packed, hit);
+
+        for (const Object *o : _bounded)
+        {
+            o->intersect(ray, hit);
+        }
+    }
+    else
+    {
+        _bvh.intersect_leaves(ray, hit.distance, nearest);
+    }
+
+    if (!hit.object)
+    {
+        return std::nullopt;
+    }
+
+    // Only the nearest hit is turned into a full intersection.
+    return hit.object->intersection(ray, hit);
+}
+
+bool Scene::occluded(const Ray &ray, double t_max) const
+{
+    PackedRay packed(ray);
+
+    if (_planes.occluded(packed, t_max))
+    {
+        return true;
+    }
+
+    for (const Object *o : _unbounded)
+    {
+        if (o->occluded(ray, t_max))
+        {
+            return true;
+        }
+    }
+
+    if (_flat)
+    {
+        if (_spheres.occluded(packed, t_max) ||
+            _cylinders.occluded(packed, t_max) ||
+            _quads.occluded(packed, t_max) ||
+            _disks.occluded(packed, t_max) ||
+            _boxes.occluded(packed, t_max))
+        {
+            return true;
+        }
+
+        for (const Object *o : _bounded)
+        {
+            if (o->occluded(ray, t_max))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return _bvh.occluded_leaves(ray, t_max,
+        [&](uint32_t offset, uint32_t count)
+        {
+            return for_each_run(offset, count,
+                [&](PrimitiveRef::Type type, uint32_t first, uint32_t n)
+                {
+                    switch (type)
+                    {
+                        case PrimitiveRef::SPHERE:
+                            return _spheres.occluded(packed, first, n, t_max);
+
+                        case PrimitiveRef::CYLINDER:
+                            return _cylinders.occluded(packed, first, n,
+                                t_max);
+
+                        case PrimitiveRef::QUAD:
+                            return _quads.occluded(packed, first, n, t_max);
+
+                        case PrimitiveRef::DISK:
+                            return _disks.occluded(packed, first, n, t_max);
+
+                        case PrimitiveRef::BOX:
+                            return _boxes.occluded(packed, first, n, t_max);
+
+                        default:
+                            for (uint32_t i = first; i < first + n; ++i)
+                            {
+                                if (_bounded[i]->occluded(ray, t_max))
+                                {
+                                    return true;
+                                }
+                            }
+
+                            return false;
+                    }
+                });
+        });
 }
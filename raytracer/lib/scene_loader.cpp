@@ -41,7 +41,7 @@ std::unique_ptr<Scene> SceneLoader::scene_1()
     t.push_back(Triangle { .a = 0, .b = 1, .c = 2 });
 
     scene->objects().push_back(std::unique_ptr<Mesh>(
-        new Mesh(v, t, &_glass)));
+        new Mesh(v, t, &_glass, _bvh_options)));
 
     scene->point_lights().push_back(std::unique_ptr<PointLight>(
         new PointLight(glm::dvec3(-20, 20, 20), 1.5d)));
@@ -57,37 +57,20 @@ std::unique_ptr<Scene> SceneLoader::scene_2()
 {
     auto scene = std::unique_ptr<Scene>(new Scene());
 
-    scene->objects().push_back(std::unique_ptr<Sphere>(
-        new Sphere(glm::dvec3(1e5 + 20, 0, -20), 1e5, &_ivory)));
-    scene->objects().push_back(std::unique_ptr<Sphere>(
-        new Sphere(glm::dvec3(-1e5 - 20, 0, -20), 1e5, &_ivory)));
-    scene->objects().push_back(std::unique_ptr<Sphere>(
-        new Sphere(glm::dvec3(0, 0, 1e5 + 0.5), 1e5, &_ivory)));
-    scene->objects().push_back(std::unique_ptr<Sphere>(
-        new Sphere(glm::dvec3(0, 0, -1e5 - 40), 1e5, &_ivory)));
-    scene->objects().push_back(std::unique_ptr<Sphere>(
-        new Sphere(glm::dvec3(0, -1e5 - 10, -20), 1e5, &_ivory)));
-    scene->objects().push_back(std::unique_ptr<Sphere>(
-        new Sphere(glm::dvec3(0, 1e5 + 14, -20), 1e5, &_ivory)));
+    // The room is seen from inside a box, which takes the six walls.
+    scene->objects().push_back(std::unique_ptr<Box>(
+        new Box(glm::dvec3(-20, -10, -40), glm::dvec3(20, 14, 0.5),
+        &_ivory)));
     scene->objects().push_back(std::unique_ptr<Sphere>(
         new Sphere(glm::dvec3(8, -2, -24), 8, &_mirror)));
     scene->objects().push_back(std::unique_ptr<Sphere>(
         new Sphere(glm::dvec3(-10, -5, -18), 5, &_clean)));
 
-    std::vector<Vertex> v;
-    std::vector<Triangle> t;
-
-    v.push_back(Vertex { .position = glm::vec3(-15, 13, -25),
-        .normal = glm::vec3(0, -1, 0) });
-    v.push_back(Vertex { .position = glm::vec3(15, 13, -25),
-        .normal = glm::vec3(0, -1, 0) });
-    v.push_back(Vertex { .position = glm::vec3(0, 13, -15),
-        .normal = glm::vec3(0, -1, 0) });
-
-    t.push_back(Triangle { .a = 0, .b = 1, .c = 2 });
-
-    scene->objects().push_back(std::unique_ptr<Mesh>(
-        new Mesh(v, t, &_rubber)));
+    // The ceiling light faces down; it is sampled directly by the path
+    // tracer.
+    scene->objects().push_back(std::unique_ptr<Quad>(
+        new Quad(glm::dvec3(-7.5, 13, -26.5), glm::dvec3(15, 0, 0),
+        glm::dvec3(0, 0, 10), &_rubber)));
 
     scene->point_lights().push_back(std::unique_ptr<PointLight>(
         new PointLight(glm::dvec3(0, 5, -20), 1.5d)));
@@ -100,7 +83,7 @@ std::unique_ptr<Scene> SceneLoader::scene_3()
     auto scene = std::unique_ptr<Scene>(new Scene());
     Model model;
 
-    if (!model.load("../bunny.obj", &_glass))
+    if (!model.load("../bunny.obj", &_glass, _bvh_options))
     {
         return nullptr;
     }
@@ -115,3 +98,79 @@ std::unique_ptr<Scene> SceneLoader::scene_3()
 
     return scene;
 }
+
+std::unique_ptr<Scene> SceneLoader::scene_4()
+{
+    auto scene = std::unique_ptr<Scene>(new Scene());
+    Model model;
+
+    if (!model.load("../bunny.obj", &_glass, _bvh_options))
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<const Mesh> bunny = std::move(model.mesh());
+    const Material *materials[] = { &_ivory, &_green, &_mirror, &_glass,
+        &_white };
+
+    for (int i = 0; i < 40; ++i)
+    {
+        for (int j = 0; j < 25; ++j)
+        {
+            int k = i * 25 + j;
+            glm::dmat4 transform = glm::translate(glm::dmat4(1.0d),
+                glm::dvec3(2.0d * (i - 19.5d), 0, -2.0d * j - 1.0d));
+
+            transform = glm::rotate(transform, 0.7d * k,
+                glm::dvec3(0, 1, 0));
+            transform = glm::scale(transform,
+                glm::dvec3(0.6d + 0.1d * (k % 5)));
+
+            scene->objects().push_back(std::unique_ptr<Instance>(
+                new Instance(bunny, transform, materials[k % 5])));
+        }
+    }
+
+    scene->objects().push_back(std::unique_ptr<Plane>(
+        new Plane(glm::normalize(glm::dvec3(0, 1, 0)),
+        glm::dvec3(0), &_ivory)));
+
+    scene->point_lights().push_back(std::unique_ptr<PointLight>(
+        new PointLight(glm::dvec3(-10, 15, 5), 1.5d)));
+    scene->point_lights().push_back(std::unique_ptr<PointLight>(
+        new PointLight(glm::dvec3(20, 10, -20), 0.8d)));
+
+    return scene;
+}
+
+std::unique_ptr<Scene> SceneLoader::scene_5()
+{
+    auto scene = std::unique_ptr<Scene>(new Scene());
+    const Material *materials[] = { &_ivory, &_green, &_mirror, &_glass,
+        &_white };
+
+    // A million spheres on a grid, all held in the scene BVH.
+    for (int i = 0; i < 1000; ++i)
+    {
+        for (int j = 0; j < 1000; ++j)
+        {
+            int k = i * 1000 + j;
+            double radius = 0.15d + 0.05d * (k % 7);
+
+            scene->objects().push_back(std::unique_ptr<Sphere>(
+                new Sphere(glm::dvec3(i - 499.5d, radius, -j - 1.0d),
+                radius, materials[k % 5])));
+        }
+    }
+
+    scene->objects().push_back(std::unique_ptr<Plane>(
+        new Plane(glm::normalize(glm::dvec3(0, 1, 0)),
+        glm::dvec3(0), &_ivory)));
+
+    scene->point_lights().push_back(std::unique_ptr<PointLight>(
+        new PointLight(glm::dvec3(-10, 15, 5), 1.5d)));
+    scene->point_lights().push_back(std::unique_ptr<PointLight>(
+        new PointLight(glm::dvec3(20, 10, -20), 0.8d)));
+
+    return scene;
+}
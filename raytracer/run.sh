@@ -2,7 +2,7 @@
 
 cd build
 
-for scene in 1 2 3
+for scene in 1 2 3 4 5
 do
     ./rt -scene ${scene} -threads 8 -out out_${scene}.bmp
     echo